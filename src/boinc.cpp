@@ -14,6 +14,7 @@
 #include "fermat.h"
 #include "proof.h"
 #include "pocklington.h"
+#include "support.h"
 #include "boinc.h"
 
 using namespace arithmetic;
@@ -53,6 +54,7 @@ int boinc_main(int argc, char *argv[])
 {
     int i;
     GWState gwstate;
+    GWScratchPool scratch(gwstate);
     Params params;
     uint64_t maxMem = 0;
     int proof_op = Proof::NO_OP;
@@ -342,7 +344,8 @@ int boinc_main(int argc, char *argv[])
     {
     }
 
-    gwstate.done();
+    report_peak_memory(logging);
+    GWScratchPool::done(gwstate);
 
     return 0;
 }
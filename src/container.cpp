@@ -0,0 +1,508 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#include "container.h"
+#include "md5.h"
+#include "support.h"
+#include "task.h"
+#include "exception.h"
+
+using namespace arithmetic;
+
+static uint32_t name_tag(const std::string& name)
+{
+    return crc32c(0, name.data(), name.size());
+}
+
+// Container layout:
+//   header  [MAGIC_NUM, VERSION, max_slots, copies, hash], HEADER_SIZE bytes
+//   index   max_slots entries [name, offset, capacity], HEADER_SIZE bytes each, padded to BLOCK_SIZE
+//   slots   one or two copies of capacity bytes each, BLOCK_SIZE-aligned
+// Record in a slot copy:
+//   header  [MAGIC_NUM, sequence, size, md5 or crc32c hex string, crc32c of the slot name], HEADER_SIZE bytes
+//   data    size bytes, padded to BLOCK_SIZE
+
+Container::Container(const std::string& filename, Logging& logging, int max_slots, int copies, int hash) : _filename(filename), _logging(logging), _max_slots(max_slots), _copies(copies), _hash(hash)
+{
+    if (!open())
+        create();
+}
+
+Container::~Container()
+{
+    if (_fd != nullptr)
+        fclose(_fd);
+}
+
+bool Container::open()
+{
+    _fd = fopen(_filename.data(), "r+b");
+    if (_fd == nullptr)
+        return false;
+
+    uint32_t header[5];
+    size_t header_read = fread(header, sizeof(uint32_t), 5, _fd);
+    // An empty file was cut before the header was written, it holds no records.
+    if (header_read == 0 && feof(_fd))
+    {
+        fclose(_fd);
+        _fd = nullptr;
+        return false;
+    }
+    if (header_read != 5 || header[0] != MAGIC_NUM || header[1] != VERSION || header[2] == 0 || header[3] < 1 || header[3] > 2 || header[4] > HASH_CRC32C)
+    {
+        fclose(_fd);
+        _fd = nullptr;
+        _logging.error("%s is corrupt or was written by a different version.\n", _filename.data());
+        throw TaskAbortException();
+    }
+    _max_slots = header[2];
+    _copies = header[3];
+    _hash = header[4];
+    _end = align(HEADER_SIZE*(1 + (uint64_t)_max_slots));
+
+    std::vector<char> index(HEADER_SIZE*(size_t)_max_slots);
+    seek(HEADER_SIZE);
+    if (fread(index.data(), 1, index.size(), _fd) != index.size())
+    {
+        fclose(_fd);
+        _fd = nullptr;
+        _logging.error("%s is corrupt.\n", _filename.data());
+        throw TaskAbortException();
+    }
+    for (int i = 0; i < _max_slots; i++)
+    {
+        char* entry = index.data() + HEADER_SIZE*i;
+        if (entry[0] == 0)
+            break;
+        Slot slot;
+        slot.name.assign(entry, strnlen(entry, NAME_SIZE));
+        if (find(slot.name) >= 0)
+            continue;
+        slot.offset = *(uint64_t*)(entry + NAME_SIZE);
+        slot.capacity = *(uint64_t*)(entry + NAME_SIZE + 8);
+        uint32_t seq0, seq1;
+        bool valid0 = read_copy(slot, 0, seq0, nullptr);
+        bool valid1 = _copies == 2 && read_copy(slot, 1, seq1, nullptr);
+        slot.sequence = valid0 && (!valid1 || (int32_t)(seq0 - seq1) > 0) ? seq0 : valid1 ? seq1 : 0;
+        if (_end < slot.offset + _copies*slot.capacity)
+            _end = slot.offset + _copies*slot.capacity;
+        _slots.push_back(std::move(slot));
+    }
+
+    // The gaps between the slots are regions left by grown records, they are reused.
+    std::vector<Slot*> order;
+    for (auto& slot : _slots)
+        order.push_back(&slot);
+    std::sort(order.begin(), order.end(), [](Slot* a, Slot* b) { return a->offset < b->offset; });
+    uint64_t offset = align(HEADER_SIZE*(1 + (uint64_t)_max_slots));
+    _free.clear();
+    for (auto slot : order)
+    {
+        if (slot->offset > offset)
+            _free.push_back({offset, slot->offset - offset});
+        offset = std::max(offset, slot->offset + _copies*slot->capacity);
+    }
+    truncate();
+
+    return true;
+}
+
+void Container::create()
+{
+    _fd = fopen(_filename.data(), "w+b");
+    if (_fd == nullptr)
+    {
+        _logging.error("Can not create %s.\n", _filename.data());
+        throw TaskAbortException();
+    }
+    _slots.clear();
+    _free.clear();
+    _end = align(HEADER_SIZE*(1 + (uint64_t)_max_slots));
+
+    std::vector<char> header(_end);
+    *(uint32_t*)header.data() = MAGIC_NUM;
+    *(uint32_t*)(header.data() + 4) = VERSION;
+    *(uint32_t*)(header.data() + 8) = _max_slots;
+    *(uint32_t*)(header.data() + 12) = _copies;
+    *(uint32_t*)(header.data() + 16) = _hash;
+    seek(0);
+    fwrite(header.data(), 1, header.size(), _fd);
+    sync();
+}
+
+void Container::remove()
+{
+    if (_fd != nullptr)
+        fclose(_fd);
+    _fd = nullptr;
+    _slots.clear();
+    _free.clear();
+    ::remove(_filename.data());
+}
+
+void Container::seek(uint64_t offset)
+{
+#ifdef _WIN32
+    _fseeki64(_fd, offset, SEEK_SET);
+#else
+    fseeko(_fd, offset, SEEK_SET);
+#endif
+}
+
+// Cuts the file at the end of the last slot, records written past it were never indexed.
+void Container::truncate()
+{
+    fflush(_fd);
+#ifdef _WIN32
+    _chsize_s(_fileno(_fd), _end);
+#else
+    if (ftruncate(fileno(_fd), (off_t)_end) != 0)
+        _logging.debug("Can not truncate %s.\n", _filename.data());
+#endif
+}
+
+void Container::sync()
+{
+    fflush(_fd);
+#ifdef _WIN32
+    _commit(_fileno(_fd));
+#else
+    fsync(fileno(_fd));
+#endif
+}
+
+// CRC32C is stored as 8 hex digits padded with zeros to the size of the MD5 string.
+void Container::digest(const char* data, size_t size, char* hash)
+{
+    if (_hash == HASH_CRC32C)
+    {
+        memset(hash, 0, 33);
+        snprintf(hash, 33, "%08x", crc32c(0, data, size));
+    }
+    else
+        md5_raw_input(hash, (unsigned char*)data, (int)size);
+}
+
+int Container::find(const std::string& name)
+{
+    for (int i = 0; i < (int)_slots.size(); i++)
+        if (_slots[i].name == name)
+            return i;
+    return -1;
+}
+
+int Container::allocate(const std::string& name, size_t size)
+{
+    int i = find(name);
+    uint64_t capacity = align(HEADER_SIZE + size) + BLOCK_SIZE;
+    if (i >= 0 && _slots[i].capacity >= HEADER_SIZE + size)
+        return i;
+    if (i < 0)
+    {
+        if (name.size() >= NAME_SIZE || (int)_slots.size() >= _max_slots)
+        {
+            _logging.error("Too many records in %s.\n", _filename.data());
+            throw TaskAbortException();
+        }
+        i = (int)_slots.size();
+        _slots.emplace_back();
+        _slots[i].name = name;
+        _slots[i].sequence = 0;
+    }
+
+    // The new region is written before the index entry points to it, the old records stay valid until then.
+    auto it = std::find_if(_free.begin(), _free.end(), [&](Region& region) { return region.length >= _copies*capacity; });
+    if (it != _free.end())
+    {
+        _slots[i].offset = it->offset;
+        it->offset += _copies*capacity;
+        it->length -= _copies*capacity;
+        if (it->length == 0)
+            _free.erase(it);
+    }
+    else
+    {
+        _slots[i].offset = _end;
+        _end += _copies*capacity;
+    }
+    _slots[i].capacity = capacity;
+
+    // A reused region may still hold valid records of another slot, they are wiped before the index points here.
+    char zero[HEADER_SIZE];
+    memset(zero, 0, HEADER_SIZE);
+    for (int copy = 0; copy < _copies; copy++)
+    {
+        seek(_slots[i].offset + copy*capacity);
+        fwrite(zero, 1, HEADER_SIZE, _fd);
+    }
+    if (ferror(_fd))
+    {
+        _logging.error("Error writing %s.\n", _filename.data());
+        throw TaskAbortException();
+    }
+    sync();
+    return i;
+}
+
+// Returns a region no index entry points to, a region at the end of the file is cut off.
+void Container::release(uint64_t offset, uint64_t length)
+{
+    auto it = std::lower_bound(_free.begin(), _free.end(), offset, [](Region& region, uint64_t offset) { return region.offset < offset; });
+    it = _free.insert(it, {offset, length});
+    if (it + 1 != _free.end() && it->offset + it->length == (it + 1)->offset)
+    {
+        it->length += (it + 1)->length;
+        _free.erase(it + 1);
+    }
+    if (it != _free.begin() && (it - 1)->offset + (it - 1)->length == it->offset)
+    {
+        (it - 1)->length += it->length;
+        it = _free.erase(it) - 1;
+    }
+    if (it->offset + it->length == _end)
+    {
+        _end = it->offset;
+        _free.erase(it);
+        truncate();
+    }
+}
+
+void Container::write_index(int index)
+{
+    char entry[HEADER_SIZE];
+    memset(entry, 0, HEADER_SIZE);
+    memcpy(entry, _slots[index].name.data(), _slots[index].name.size());
+    *(uint64_t*)(entry + NAME_SIZE) = _slots[index].offset;
+    *(uint64_t*)(entry + NAME_SIZE + 8) = _slots[index].capacity;
+    seek(HEADER_SIZE*(1 + (uint64_t)index));
+    fwrite(entry, 1, HEADER_SIZE, _fd);
+}
+
+// The last index entry takes the place of the erased one, the entries stay contiguous.
+void Container::erase(const std::string& name)
+{
+    int i = find(name);
+    if (i < 0 || _fd == nullptr)
+        return;
+    Slot slot = std::move(_slots[i]);
+    int last = (int)_slots.size() - 1;
+    if (i != last)
+    {
+        _slots[i] = std::move(_slots[last]);
+        write_index(i);
+    }
+    _slots.pop_back();
+    char entry[HEADER_SIZE];
+    memset(entry, 0, HEADER_SIZE);
+    seek(HEADER_SIZE*(1 + (uint64_t)last));
+    fwrite(entry, 1, HEADER_SIZE, _fd);
+    sync();
+    release(slot.offset, _copies*slot.capacity);
+}
+
+void Container::reserve(const std::string& name, size_t size)
+{
+    if (_fd == nullptr)
+        create();
+    if (find(name) >= 0)
+        return;
+    int i = allocate(name, size);
+    write_index(i);
+#ifdef __linux__
+    posix_fallocate(fileno(_fd), _slots[i].offset, _copies*_slots[i].capacity);
+#endif
+}
+
+bool Container::import(const std::string& name, File& file)
+{
+    file.read_buffer();
+    if (file.buffer().empty())
+        return false;
+    write(name, file.buffer().data(), file.buffer().size());
+    file.clear();
+    return true;
+}
+
+// Moves the records from the end of the file into free regions below them, then cuts the file.
+// A record is copied before its index entry points to the copy, an interrupted move leaves the old one in place.
+void Container::compact()
+{
+    if (_fd == nullptr)
+        return;
+    std::vector<int> order;
+    for (int i = 0; i < (int)_slots.size(); i++)
+        order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return _slots[a].offset > _slots[b].offset; });
+    std::vector<char> buffer;
+    for (int i : order)
+    {
+        Slot& slot = _slots[i];
+        uint64_t length = _copies*slot.capacity;
+        auto it = std::find_if(_free.begin(), _free.end(), [&](Region& region) { return region.offset < slot.offset && region.length >= length; });
+        if (it == _free.end())
+            continue;
+        uint64_t offset = it->offset;
+        for (uint64_t pos = 0; pos < length; pos += buffer.size())
+        {
+            // The unwritten tail of the last slot reads as zeros.
+            buffer.resize((size_t)std::min(length - pos, (uint64_t)BLOCK_SIZE*256));
+            seek(slot.offset + pos);
+            size_t read = fread(buffer.data(), 1, buffer.size(), _fd);
+            memset(buffer.data() + read, 0, buffer.size() - read);
+            seek(offset + pos);
+            fwrite(buffer.data(), 1, buffer.size(), _fd);
+        }
+        if (ferror(_fd))
+        {
+            _logging.error("Error writing %s.\n", _filename.data());
+            throw TaskAbortException();
+        }
+        sync();
+        it->offset += length;
+        it->length -= length;
+        if (it->length == 0)
+            _free.erase(it);
+        std::swap(offset, slot.offset);
+        write_index(i);
+        sync();
+        release(offset, length);
+    }
+}
+
+bool Container::read_copy(Slot& slot, int copy, uint32_t& sequence, std::vector<char>* buffer)
+{
+    char header[HEADER_SIZE];
+    seek(slot.offset + copy*slot.capacity);
+    if (fread(header, 1, HEADER_SIZE, _fd) != HEADER_SIZE || *(uint32_t*)header != MAGIC_NUM || *(uint32_t*)(header + 48) != name_tag(slot.name))
+        return false;
+    sequence = *(uint32_t*)(header + 4);
+    uint64_t size = *(uint64_t*)(header + 8);
+    if (HEADER_SIZE + size > slot.capacity)
+        return false;
+    if (buffer == nullptr)
+        return true;
+
+    if (!read_data(slot.offset + copy*slot.capacity + HEADER_SIZE, (size_t)size, *buffer))
+        return false;
+    char hash[33];
+    digest(buffer->data(), (size_t)size, hash);
+    return memcmp(hash, header + 16, 32) == 0;
+}
+
+bool Container::read_data(uint64_t offset, size_t size, std::vector<char>& buffer)
+{
+    buffer.resize(size);
+    if (size == 0)
+        return true;
+    seek(offset);
+    return fread(buffer.data(), 1, size, _fd) == size;
+}
+
+bool Container::read(const std::string& name, std::vector<char>& buffer)
+{
+    int i = find(name);
+    if (i < 0 || _fd == nullptr)
+        return false;
+    Slot& slot = _slots[i];
+
+    // The newest copy first, the other one is the journal.
+    uint32_t sequence;
+    int copy = _copies == 2 ? slot.sequence & 1 : 0;
+    if (read_copy(slot, copy, sequence, &buffer) && sequence == slot.sequence)
+        return !buffer.empty();
+    if (_copies == 2 && read_copy(slot, 1 - copy, sequence, &buffer))
+    {
+        slot.sequence = sequence;
+        _logging.warning("Record %s in %s is corrupt, using the previous one.\n", name.data(), _filename.data());
+        return !buffer.empty();
+    }
+    buffer.clear();
+    return false;
+}
+
+void Container::write(const std::string& name, const char* data, size_t size)
+{
+    if (_fd == nullptr)
+        create();
+    int i = find(name);
+    if (i < 0 && size == 0)
+        return;
+    uint64_t offset = i >= 0 ? _slots[i].offset : 0;
+    uint64_t capacity = i >= 0 ? _slots[i].capacity : 0;
+    i = allocate(name, size);
+    Slot& slot = _slots[i];
+    uint32_t sequence = slot.sequence + 1;
+
+    char header[HEADER_SIZE];
+    memset(header, 0, HEADER_SIZE);
+    *(uint32_t*)header = MAGIC_NUM;
+    *(uint32_t*)(header + 4) = sequence;
+    *(uint64_t*)(header + 8) = size;
+    char hash[33];
+    digest(data, size, hash);
+    memcpy(header + 16, hash, 32);
+    *(uint32_t*)(header + 48) = name_tag(name);
+
+    seek(slot.offset + (_copies == 2 ? sequence & 1 : 0)*slot.capacity);
+    fwrite(header, 1, HEADER_SIZE, _fd);
+    if (size > 0)
+        fwrite(data, 1, size, _fd);
+    size_t padding = (size_t)(align(HEADER_SIZE + size) - HEADER_SIZE - size);
+    if (padding > 0)
+    {
+        char zero[BLOCK_SIZE];
+        memset(zero, 0, padding);
+        fwrite(zero, 1, padding, _fd);
+    }
+    if (ferror(_fd))
+    {
+        _logging.error("Error writing %s.\n", _filename.data());
+        throw TaskAbortException();
+    }
+    sync();
+    slot.sequence = sequence;
+    if (offset != slot.offset)
+    {
+        write_index(i);
+        sync();
+        if (capacity > 0)
+            release(offset, _copies*capacity);
+    }
+}
+
+File* ContainerFile::add_child(const std::string& name, uint32_t fingerprint)
+{
+    _children.emplace_back(new ContainerFile(_container, _filename + "." + name, fingerprint));
+    _children.back()->hash = hash;
+    return _children.back().get();
+}
+
+void ContainerFile::read_buffer()
+{
+    if (!_buffer.empty())
+        return;
+    _container.read(_filename, _buffer);
+}
+
+void ContainerFile::commit_writer(Writer& writer)
+{
+    _container.write(_filename, writer.buffer().data(), writer.buffer().size());
+    _buffer = std::move(writer.buffer());
+}
+
+void ContainerFile::clear(bool recursive)
+{
+    std::vector<char>().swap(_buffer);
+    _container.erase(_filename);
+    if (recursive)
+        for (auto& child : _children)
+            child->clear(true);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "file.h"
+#include "logging.h"
+
+// Single file holding named records in preallocated slots.
+// With two copies per slot they are written alternately, so a torn write leaves the previous record intact.
+class Container
+{
+public:
+    static const uint32_t MAGIC_NUM = 0x4e4a5250;
+    static const int VERSION = 2;
+    static const int BLOCK_SIZE = 4096;
+    static const int HEADER_SIZE = 64;
+    static const int NAME_SIZE = 40;
+    static const int HASH_MD5 = 0;
+    static const int HASH_CRC32C = 1;
+
+public:
+    Container(const std::string& filename, Logging& logging, int max_slots = 64, int copies = 2, int hash = HASH_MD5);
+    ~Container();
+
+    bool read(const std::string& name, std::vector<char>& buffer);
+    void write(const std::string& name, const char* data, size_t size);
+    void erase(const std::string& name);
+    void reserve(const std::string& name, size_t size);
+    bool import(const std::string& name, File& file);
+    void compact();
+    void remove();
+
+    std::string& filename() { return _filename; }
+    int copies() { return _copies; }
+    int hash() { return _hash; }
+
+protected:
+    struct Slot
+    {
+        std::string name;
+        uint64_t offset;
+        uint64_t capacity;
+        uint32_t sequence;
+    };
+    struct Region
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    bool open();
+    void create();
+    int find(const std::string& name);
+    int allocate(const std::string& name, size_t size);
+    void release(uint64_t offset, uint64_t length);
+    void truncate();
+    void write_index(int index);
+    bool read_copy(Slot& slot, int copy, uint32_t& sequence, std::vector<char>* buffer);
+    bool read_data(uint64_t offset, size_t size, std::vector<char>& buffer);
+    void seek(uint64_t offset);
+    void sync();
+    void digest(const char* data, size_t size, char* hash);
+
+    static uint64_t align(uint64_t size) { return (size + BLOCK_SIZE - 1)/BLOCK_SIZE*BLOCK_SIZE; }
+
+protected:
+    std::string _filename;
+    Logging& _logging;
+    int _max_slots;
+    int _copies;
+    int _hash;
+    FILE* _fd = nullptr;
+    std::vector<Slot> _slots;
+    std::vector<Region> _free;
+    uint64_t _end = 0;
+};
+
+class ContainerFile : public File
+{
+public:
+    ContainerFile(Container& container, const std::string& name, uint32_t fingerprint) : File(name, fingerprint), _container(container) { }
+
+    File* add_child(const std::string& name, uint32_t fingerprint) override;
+    void read_buffer() override;
+    void commit_writer(Writer& writer) override;
+    void clear(bool recursive = false) override;
+
+    Container& container() { return _container; }
+
+protected:
+    Container& _container;
+};
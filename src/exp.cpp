@@ -1,15 +1,59 @@
 
 #include <cmath>
+#include <algorithm>
 #include <iostream>
+#include <climits>
 #include <string.h>
 
 #include "gwnum.h"
 #include "cpuid.h"
 #include "exp.h"
 #include "exception.h"
+#include "md5.h"
+#include "integer.h"
 
 using namespace arithmetic;
 
+thread_local GWScratchPool* GWScratchPool::_current = nullptr;
+
+GWScratchPool::GWScratchPool(GWState& gwstate) : _gwstate(gwstate), _outer(_current)
+{
+    _current = this;
+}
+
+GWScratchPool::~GWScratchPool()
+{
+    _free.clear();
+    _current = _outer;
+}
+
+void GWScratchPool::done(GWState& gwstate)
+{
+    GWScratchPool* pool;
+    for (pool = _current; pool != nullptr && &pool->_gwstate != &gwstate; pool = pool->_outer);
+    if (pool != nullptr)
+        pool->_free.clear();
+    gwstate.done();
+}
+
+GWScratch::GWScratch(GWState& gwstate)
+{
+    for (_pool = GWScratchPool::_current; _pool != nullptr && &_pool->_gwstate != &gwstate; _pool = _pool->_outer);
+    if (_pool == nullptr || _pool->_free.empty())
+        _X.reset(new GWNum(gwstate.gwarithmetic()));
+    else
+    {
+        _X = std::move(_pool->_free.back());
+        _pool->_free.pop_back();
+    }
+}
+
+GWScratch::~GWScratch()
+{
+    if (_X && _pool != nullptr)
+        _pool->_free.push_back(std::move(_X));
+}
+
 void BaseExp::done()
 {
     InputTask::done();
@@ -21,7 +65,7 @@ void CarefulExp::init(InputNum* input, GWState* gwstate, Logging* logging)
     GWASSERT(!smooth());
     GWASSERT(_x0 != 0 || !_X0.empty());
     GWASSERT(_x0 <= (uint32_t)gwstate->maxmulbyconst);
-    BaseExp::init(input, gwstate, nullptr, nullptr, logging, _exp.bitlen() - 1 + (!_tail.empty() ? 1 : 0));
+    BaseExp::init(input, gwstate, nullptr, nullptr, logging, _exp.bitlen() - 1 + (has_tail() ? 1 : 0));
     _state_update_period = MULS_PER_STATE_UPDATE*2/3;
     _logging->set_prefix(input->display_text() + " ");
     if (state() != nullptr)
@@ -32,54 +76,99 @@ void CarefulExp::init(InputNum* input, GWState* gwstate, Logging* logging)
         set_state<State>(0, _X0);
 }
 
+double CarefulExp::cost()
+{
+    int n = _exp.bitlen() - 1;
+    if (n < CHECKED_MIN_BITLEN)
+        return n*1.5;
+    int L, L2;
+    StrongCheckMultipointExp::Gerbicz_params(n/CHECKED_COUNT, 1.0, L, L2);
+    return n + n/L + n/L2*(2*L + std::log2(L2/L));
+}
+
 void CarefulExp::execute()
 {
     int i, len;
 
     len = _exp.bitlen() - 1;
-    GWNum X0(gw());
+    if (len >= CHECKED_MIN_BITLEN)
+    {
+        execute_checked();
+        return;
+    }
+    GWScratch X0(*_gwstate);
     if (!_X0.empty())
-        X0 = _X0;
+        *X0 = _X0;
     if (_x0 > 0)
         gw().setmulbyconst(_x0);
-    GWNum X(gw());
+    GWScratch X(*_gwstate);
     if (state() == nullptr)
     {
         i = 0;
         if (!_X0.empty())
-            X = X0;
+            *X = *X0;
         if (_x0 > 0)
-            X = _x0;
+            *X = _x0;
     }
     else
     {
         i = state()->iteration();
-        X = state()->X();
+        *X = state()->X();
     }
-    for (; i < len; i++, commit_execute<State>(i, X))
+    for (; i < len; i++, commit_execute<State>(i, *X))
     {
-        gw().carefully().square(X, X, (_x0 > 0 && _exp.bit(len - i - 1) ? GWMUL_MULBYCONST : 0));
+        gw().carefully().square(*X, *X, (_x0 > 0 && _exp.bit(len - i - 1) ? GWMUL_MULBYCONST : 0));
         if (!_X0.empty() && _exp.bit(len - i - 1))
-            gw().carefully().mul(X, X0, X, 0);
+            gw().carefully().mul(*X, *X0, *X, 0);
     }
     if (i < iterations())
     {
-        GWNum T(gw());
-        T = _tail;
-        gw().carefully().mul(T, X, X, 0);
+        GWScratch T(*_gwstate);
+        *T = tail();
+        gw().carefully().mul(*T, *X, *X, 0);
         i++;
-        commit_execute<State>(i, X);
+        commit_execute<State>(i, *X);
     }
 
     done();
 }
 
+void CarefulExp::execute_checked()
+{
+    SubLogging logging(*_logging, Logging::LEVEL_WARNING);
+    std::unique_ptr<LiCheckExp> task;
+    Giant tail;
+    if (has_tail())
+        tail = this->tail();
+    if (_x0 > 0)
+    {
+        FastLiCheckExp* taskFast = new FastLiCheckExp(_exp, CHECKED_COUNT);
+        task.reset(taskFast);
+        if (has_tail())
+            taskFast->init(_input, _gwstate, nullptr, nullptr, &logging, _x0, std::move(tail));
+        else
+            taskFast->init(_input, _gwstate, nullptr, nullptr, &logging, _x0);
+    }
+    else
+    {
+        task.reset(new LiCheckExp(_exp, CHECKED_COUNT));
+        if (has_tail())
+            task->init(_input, _gwstate, nullptr, nullptr, &logging, _X0, std::move(tail));
+        else
+            task->init(_input, _gwstate, nullptr, nullptr, &logging, _X0);
+    }
+    task->run();
+    GWASSERT(task->state()->iteration() == iterations());
+    set_state<State>(task->state()->iteration(), task->state()->X());
+    done();
+}
+
 void MultipointExp::init(InputNum* input, GWState* gwstate, File* file, Logging* logging)
 {
     GWASSERT(smooth() || _x0 != 0 || !_X0.empty());
     GWASSERT(!smooth() || (_x0 == 0 && _X0.empty()));
     GWASSERT(_x0 <= (uint32_t)gwstate->maxmulbyconst);
-    BaseExp::init(input, gwstate, file, nullptr, logging, _points.back() + (!_tail.empty() ? 1 : 0));
+    BaseExp::init(input, gwstate, file, nullptr, logging, _points.back() + (has_tail() ? 1 : 0));
     _state_update_period = MULS_PER_STATE_UPDATE;
     if (smooth() && b() != 2)
         _state_update_period = (int)(_state_update_period/log2(b()));
@@ -99,10 +188,21 @@ void MultipointExp::init_state(State* state)
     _state.reset(state);
     _logging->progress().update(0, (int)_gwstate->handle.fft_count/2);
     _logging->set_prefix(_input->display_text() + " ");
-    if (_state->iteration() > 0)
+    if (_state && _state->iteration() > 0)
         _logging->info("restarting at %.1f%%.\n", 100.0*_state->iteration()/iterations());
 }
 
+void MultipointExp::init_exp_bits()
+{
+    int len = _exp.bitlen() - 1;
+    if (!_exp_bits.empty() || len <= 0)
+        return;
+    _exp_bits.resize((len + 63)/64, 0);
+    for (int i = 0; i < len; i++)
+        if (_exp.bit(len - i - 1))
+            _exp_bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
 void MultipointExp::setup()
 {
     if (!_X)
@@ -152,15 +252,35 @@ void MultipointExp::execute()
     }
     if (i < 30)
         gwset_carefully_count(gw().gwdata(), 30 - i);
+    _interim_next = _interim != nullptr ? _interim->next(i, iterations()) : INT_MAX;
 
     for (next_point = 0; next_point < _points.size() && i >= _points[next_point]; next_point++);
     for (; next_point < _points.size(); next_point++)
     {
-        if ((smooth() && b() == 2) || (!smooth() && _x0 > 0))
+        if (((smooth() && b() == 2) || (!smooth() && _x0 > 0)) && !_reference_kernel)
+        {
+            if (!smooth())
+                init_exp_bits();
+            while (i < _points[next_point])
+            {
+                int end = std::min(_points[next_point], _interim_next);
+                if (smooth())
+                    square_run<false, State>(i, end, X());
+                else
+                    square_run<true, State>(i, end, X());
+                if (i == _interim_next)
+                    interim(i, X());
+                if (i != _points[next_point])
+                    commit_execute<State>(i, X());
+            }
+        }
+        else if ((smooth() && b() == 2) || (!smooth() && _x0 > 0))
         {
             for (; i < _points[next_point]; i++)
             {
-                gw().square(X(), X(), (!smooth() && _exp.bit(len - i - 1) ? GWMUL_MULBYCONST : 0) | GWMUL_STARTNEXTFFT_IF(!is_last(i) && i + 1 != _points[next_point]));
+                gw().square(X(), X(), (!smooth() && _exp.bit(len - i - 1) ? GWMUL_MULBYCONST : 0) | GWMUL_STARTNEXTFFT_IF(!is_last(i) && i + 1 != _points[next_point] && i + 1 != _interim_next));
+                if (i + 1 == _interim_next)
+                    interim(i + 1, X());
                 if (i + 1 != _points[next_point])
                     commit_execute<State>(i + 1, X());
             }
@@ -182,112 +302,256 @@ void MultipointExp::execute()
             i = _points[next_point];
         }
 
-        check();
-        if (!_tmp_state)
-            _tmp_state.reset(new State());
-        static_cast<State*>(_tmp_state.get())->set(i, X());
-        if (_on_point != nullptr)
-        {
-            _logging->progress().update(_points[next_point]/(double)iterations(), (int)_gwstate->handle.fft_count/2);
-            _logging->progress_save();
-            if (_on_point(next_point, static_cast<State*>(_tmp_state.get())->X()))
-            {
-                static_cast<State*>(_tmp_state.get())->set_written();
-                _last_write = std::chrono::system_clock::now();
-            }
+        commit_point(next_point, i);
+    }
+    commit_tail(i);
+
+    done();
+}
+
+void MultipointExp::commit_point(int index, int iteration)
+{
+    check();
+    if (_interim_next <= iteration)
+        interim(iteration, X());
+    if (!_tmp_state)
+        _tmp_state.reset(new State());
+    static_cast<State*>(_tmp_state.get())->set(iteration, X());
+    if (_on_point != nullptr)
+    {
+        _logging->progress().update(_points[index]/(double)iterations(), (int)_gwstate->handle.fft_count/2);
+        _logging->progress_save();
+        if (_on_point(index, static_cast<State*>(_tmp_state.get())->X()))
+        {
+            static_cast<State*>(_tmp_state.get())->set_written();
+            _last_write = std::chrono::system_clock::now();
         }
-        _tmp_state.swap(_state);
-        on_state();
     }
-    if (i < iterations())
+    _tmp_state.swap(_state);
+    on_state();
+}
+
+void MultipointExp::commit_tail(int& iteration)
+{
+    if (iteration < iterations())
     {
-        GWNum T(gw());
-        T = _tail;
-        gw().carefully().mul(T, X(), X(), 0);
-        i++;
-        commit_execute<State>(i, X());
+        GWScratch T(*_gwstate);
+        *T = tail();
+        gw().carefully().mul(*T, X(), X(), 0);
+        iteration++;
+        commit_execute<State>(iteration, X());
     }
+}
 
-    done();
+void MultipointExp::interim(int iteration, GWNum& X)
+{
+    if (iteration == _interim_next)
+    {
+        Giant tmp;
+        tmp = X;
+        _interim->emit(iteration, tmp.to_res64(), *_logging);
+    }
+    _interim_next = _interim->next(iteration, iterations());
 }
 
-int MultipointExp::slide_init(int len)
+bool InterimResidues::load(const std::string& filename)
+{
+    FILE* fp = fopen(filename.data(), "r");
+    if (fp == nullptr)
+        return false;
+    char line[1024];
+    char mode[64];
+    char res64[17];
+    int iteration;
+    while (fgets(line, sizeof(line), fp) != nullptr)
+    {
+        const char* str = strstr(line, "RES64 at iteration ");
+        if (str != nullptr)
+        {
+            if (sscanf(str, "RES64 at iteration %d [%63[^]]]: %16s", &iteration, mode, res64) == 3 && _mode == mode)
+                _expected[iteration] = res64;
+        }
+        else if (sscanf(line, "%d %16s", &iteration, res64) == 2)
+            _expected[iteration] = res64;
+    }
+    fclose(fp);
+    return true;
+}
+
+int InterimResidues::next(int iteration, int iterations)
 {
+    int64_t next;
+    if (_pow2)
+        for (next = 1; next <= iteration; next <<= 1);
+    else
+    {
+        int64_t interval = _percent > 0 ? (int64_t)iterations*_percent/100 : _interval;
+        if (interval < 1)
+            interval = 1;
+        next = (iteration/interval + 1)*interval;
+    }
+    return next < iterations ? (int)next : INT_MAX;
+}
+
+void InterimResidues::emit(int iteration, const std::string& res64, Logging& logging)
+{
+    logging.result(false, "RES64 at iteration %d [%s]: %s.\n", iteration, _mode.data(), res64.data());
+    auto it = _expected.find(iteration);
+    if (it != _expected.end() && it->second != res64)
+    {
+        logging.error("RES64 mismatch at iteration %d, expected %s.\n", iteration, it->second.data());
+        throw TaskAbortException();
+    }
+}
+
+ExpRecoding::ExpRecoding(const arithmetic::Giant& exp, int hi, int lo, int table_size) : _hi(hi), _lo(lo), _table_size(table_size)
+{
+    int max_value = 2*table_size - 1;
     int W;
-    for (W = 1; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + len*(1 + 1/(W + 1.0)) > (1 << (W - 0)) + len*(1 + 1/(W + 2.0)); W++);
+    for (W = 1; (1 << W) <= max_value; W++);
 
-    _U.reserve((size_t)1 << (W - 1));
+    for (int i = hi; i >= lo;)
+    {
+        if (exp.bit(i) == 0)
+        {
+            i--;
+            continue;
+        }
+        int j = i - W + 1;
+        if (j < lo)
+            j = lo;
+        int value;
+        while (true)
+        {
+            for (; exp.bit(j) == 0; j++);
+            value = 0;
+            for (int k = i; k >= j; k--)
+                value = 2*value + (exp.bit(k) ? 1 : 0);
+            if (value <= max_value)
+                break;
+            j++;
+        }
+        _digits.push_back({j, i - j + 1, value});
+        i = j - 1;
+    }
+}
+
+int ExpRecoding::optimal_table_size(double len, int W, int max_size)
+{
+    int max_table = INT_MAX/2;
+    if (W != -1)
+        max_table = 1 << (W - 1);
+    if (max_size != -1 && max_table > max_size/2)
+        max_table = max_size/2;
+    int table_size;
+    for (table_size = 1; table_size < max_table && estimate(len, table_size + 1) < estimate(len, table_size); table_size++);
+    return table_size;
+}
+
+int MultipointExp::slide_init(int len)
+{
+    _table_size = table_size(len);
+
+    _U.reserve(_table_size);
     if (_U.size() <= 0)
         _U.emplace_back(gw());
     swap(_U[0], X());
-    if (W > 1)
+    if (_table_size > 1)
         gw().square(_U[0], X(), GWMUL_STARTNEXTFFT);
-    for (int i = 1; i < (1 << (W - 1)); i++)
+    for (int i = 1; i < _table_size; i++)
     {
         if (_U.size() <= i)
             _U.emplace_back(gw());
         gw().mul(X(), _U[i - 1], _U[i], GWMUL_FFT_S1 | GWMUL_FFT_S2 | GWMUL_STARTNEXTFFT);
     }
-    return W;
+    return _table_size;
+}
+
+ExpRecoding& MultipointExp::recoding()
+{
+    int len = _exp.bitlen() - 1;
+    int size = _table_size > 0 ? _table_size : table_size(len);
+    if (!_recoding || _recoding->table_size() != size)
+        _recoding.reset(new ExpRecoding(_exp, len - 1, 0, size));
+    return *_recoding;
 }
 
-void MultipointExp::slide(const arithmetic::Giant& exp, int start, int end, bool commit, int W)
+void MultipointExp::slide_digits(int len, int& i, int lo, const ExpRecoding::Digit* first, const ExpRecoding::Digit* last, bool commit)
+{
+    for (auto digit = first; digit != last; digit++)
+    {
+        for (; i >= digit->bit + digit->width; i--)
+        {
+            gw().square(X(), X(), GWMUL_STARTNEXTFFT_IF(i > lo));
+            if (commit && i > lo)
+                commit_execute<State>(len - i, X());
+        }
+        for (; i >= digit->bit; i--)
+            gw().square(X(), X(), GWMUL_STARTNEXTFFT);
+        gw().mul(_U[digit->value/2], X(), X(), GWMUL_FFT_S1 | GWMUL_STARTNEXTFFT_IF(digit->bit > lo));
+        if (commit && digit->bit > lo)
+            commit_execute<State>(len - digit->bit, X());
+    }
+}
+
+void MultipointExp::slide(const arithmetic::Giant& exp, int start, int end, bool commit, int table_size)
 {
-    int i, j;
     int len = exp.bitlen() - 1;
-    if (W == 0)
-        for (W = 1; ((size_t)1 << W) <= _U.size(); W++);
+    int hi = len - start - 1;
+    int lo = len - end;
+    int i = hi;
+    if (table_size == 0)
+        table_size = _table_size;
 
-    for (i = len - start - 1; i >= len - end;)
+    if (&exp == &_exp && !smooth() && table_size == _table_size)
     {
-        if (exp.bit(i) == 0)
+        // The precomputed recoding of the whole exponent, windows crossing the segment bounds are recoded locally.
+        std::vector<ExpRecoding::Digit>& digits = recoding().digits();
+        auto first = std::partition_point(digits.begin(), digits.end(), [&](const ExpRecoding::Digit& d) { return d.bit + d.width - 1 > hi; });
+        auto last = std::partition_point(first, digits.end(), [&](const ExpRecoding::Digit& d) { return d.bit >= lo; });
+        int top = first != last ? first->bit + first->width - 1 : lo - 1;
+        if (hi > top)
         {
-            gw().square(X(), X(), GWMUL_STARTNEXTFFT_IF(i > len - end));
-            i--;
+            ExpRecoding head(exp, hi, top + 1, table_size);
+            slide_digits(len, i, lo, head.digits().data(), head.digits().data() + head.digits().size(), commit);
         }
-        else
+        if (first != last)
         {
-            j = i - W + 1;
-            if (j < len - end)
-                j = len - end;
-            for (; exp.bit(j) == 0; j++);
-            int ui = 0;
-
-            while (i >= j)
+            slide_digits(len, i, lo, &*first, &*first + (last - first), commit);
+            int bottom = (last - 1)->bit;
+            if (bottom > lo)
             {
-                gw().square(X(), X(), GWMUL_STARTNEXTFFT);
-                ui <<= 1;
-                ui += exp.bit(i) ? 1 : 0;
-                i--;
+                ExpRecoding tail(exp, bottom - 1, lo, table_size);
+                slide_digits(len, i, lo, tail.digits().data(), tail.digits().data() + tail.digits().size(), commit);
             }
-
-            gw().mul(_U[ui/2], X(), X(), GWMUL_FFT_S1 | GWMUL_STARTNEXTFFT_IF(i > len - end));
         }
-        if (commit && i >= len - end)
-            commit_execute<State>(len - i - 1, X());
+    }
+    else
+    {
+        ExpRecoding segment(exp, hi, lo, table_size);
+        slide_digits(len, i, lo, segment.digits().data(), segment.digits().data() + segment.digits().size(), commit);
+    }
+
+    for (; i >= lo; i--)
+    {
+        gw().square(X(), X(), GWMUL_STARTNEXTFFT_IF(i > lo));
+        if (commit && i > lo)
+            commit_execute<State>(len - i, X());
     }
 }
 
 void MultipointExp::sliding_window(const arithmetic::Giant& exp)
 {
     int len = exp.bitlen() - 1;
-    int W = slide_init(len);
+    int table_size = slide_init(len);
 
-    int i = len;
-    int j = i - W + 1;
-    if (j < 0)
-        j = 0;
-    for (; exp.bit(j) == 0; j++);
-    int ui = 0;
-    while (i >= j)
-    {
-        ui <<= 1;
-        ui += exp.bit(i) ? 1 : 0;
-        i--;
-    }
-    X() = _U[ui/2];
-
-    slide(exp, len - i - 1, len, false, W);
+    ExpRecoding recoding(exp, len, 0, table_size);
+    ExpRecoding::Digit* digits = recoding.digits().data();
+    X() = _U[digits[0].value/2];
+    int i = digits[0].bit - 1;
+    slide_digits(len, i, 0, digits + 1, digits + recoding.digits().size(), false);
+    for (; i >= 0; i--)
+        gw().square(X(), X(), GWMUL_STARTNEXTFFT_IF(i > 0));
 }
 
 double MultipointExp::cost()
@@ -298,30 +562,267 @@ double MultipointExp::cost()
     else if (smooth())
     {
         double log2b = log2(b());
-        int W;
         int first = 0;
         if (_points[0] == 0)
             first = 1;
-        for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + log2b*_points[first]*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + log2b*_points[first]*(1 + 1/(W + 2.0)); W++);
-        double cost = ((1 << (W - 1)) + log2b*_points[first]*(1 + 1/(W + 1.0)));
+        double cost = ExpRecoding::estimate(log2b*_points[first], table_size(log2b*_points[first]));
         if (_points.size() > 1 + first)
         {
             cost *= (_points.size() - 1 - first);
             int last = _points[_points.size() - 1] - _points[_points.size() - 2];
-            for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + log2b*last*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + log2b*last*(1 + 1/(W + 2.0)); W++);
-            cost += ((1 << (W - 1)) + log2b*last*(1 + 1/(W + 1.0)));
+            cost += ExpRecoding::estimate(log2b*last, table_size(log2b*last));
         }
         return cost;
     }
     else
+        return recoding().cost();
+}
+
+bool WesolowskiExp::Accumulator::read(Reader& reader)
+{
+    return State::read(reader) && reader.read(_x) && reader.read(_y);
+}
+
+void WesolowskiExp::Accumulator::write(Writer& writer)
+{
+    State::write(writer);
+    writer.write(_x);
+    writer.write(_y);
+}
+
+void WesolowskiExp::hash_challenge(uint32_t fingerprint, Giant& x, Giant& y, int T, Giant& l)
+{
+    MD5_CTX context;
+    MD5Init(&context);
+    MD5Update(&context, (unsigned char *)&fingerprint, 4);
+    MD5Update(&context, (unsigned char *)&T, 4);
+    MD5Update(&context, (unsigned char *)x.data(), x.size()*4);
+    MD5Update(&context, (unsigned char *)y.data(), y.size()*4);
+    l = Giant(GiantsArithmetic::default_arithmetic(), 4);
+    MD5Final((unsigned char *)l.data(), &context);
+    l.data()[0] |= 1;
+    l.data()[3] |= 0x80000000;
+    l.arithmetic().init(l.data(), 4, l);
+
+    // The next 128-bit probable prime.
+    Giant r, exp;
+    while (true)
     {
-        int len = _exp.bitlen() - 1;
-        int W;
-        for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + len*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + len*(1 + 1/(W + 2.0)); W++);
-        return (1 << (W - 1)) + _points.back()*(1 + 1/(W + 1.0));
+        PrimeIterator it = PrimeIterator::get();
+        for (; *it < 1000 && l%(*it) != 0; it++);
+        if (*it >= 1000)
+        {
+            r = 3;
+            exp = l;
+            exp -= 1;
+            r.arithmetic().powermod(r, exp, l, r);
+            if (r == 1)
+                break;
+        }
+        l += 2;
     }
 }
 
+void WesolowskiExp::clear_files()
+{
+    for (auto file : _file_checkpoints)
+        file->clear();
+    if (_file_accumulator != nullptr)
+        _file_accumulator->clear();
+}
+
+// finish() holds the checkpoints, 2^k - 1 buckets and 4 more numbers. The buckets never outnumber the checkpoints.
+void WesolowskiExp::layout()
+{
+    int count = _count_max;
+    if (_max_size > 0 && count > _max_size/2)
+        count = std::max(1, _max_size/2);
+    // pi costs T/k bucket multiplications plus 2^(k+1) per window of k bits.
+    auto overhead = [&](int k) { return _T/(double)k + (double)(2 << k)*_T/((double)k*count); };
+    auto fits = [&](int k) { return (1 << k) - 1 <= count && (_max_size <= 0 || count + (1 << k) + 3 <= _max_size); };
+    for (_k = 1; _k < 16 && overhead(_k + 1) < overhead(_k) && fits(_k + 1); _k++);
+    _windows = ((_T + count - 1)/count + _k - 1)/_k;
+    _count = (_T + _windows*_k - 1)/(_windows*_k);
+}
+
+void WesolowskiExp::checkpoint(int index)
+{
+    State state;
+    state.set(index*_windows*_k, X());
+    _file_checkpoints[index]->write(state);
+    _file_checkpoints[index]->free_buffer();
+}
+
+// Past T the result is gone, only a complete accumulator can be used.
+void WesolowskiExp::finish(int iteration)
+{
+    int i, j, t, d;
+    Giant y;
+    if (iteration == _T)
+        y = X();
+    if (!_accumulator || iteration != _T || _accumulator->y() != y)
+    {
+        _accumulator.reset(new Accumulator());
+        bool valid = _file_accumulator->read(*_accumulator) && (iteration != _T || _accumulator->y() == y) && _accumulator->window() <= _windows && (_accumulator->window() == 0 || !_accumulator->pi().empty());
+        _file_accumulator->free_buffer();
+        if (iteration != _T && (!valid || _accumulator->window() != _windows))
+        {
+            _accumulator.reset();
+            _logging->error("%s is missing or corrupt, the certificate can not be built.\n", _file_accumulator->filename().data());
+            return;
+        }
+        if (!valid)
+        {
+            _accumulator.reset(new Accumulator());
+            _accumulator->y() = std::move(y);
+        }
+    }
+    if (_accumulator->window() == _windows)
+    {
+        hash_challenge(_gwstate->fingerprint, _accumulator->x(), _accumulator->y(), _T, _challenge);
+        return;
+    }
+
+    std::vector<GWNum> P;
+    P.reserve(_count);
+    State state;
+    for (j = 0; j < _count; j++)
+    {
+        if (!_file_checkpoints[j]->read(state) || state.iteration() != j*_windows*_k)
+        {
+            _logging->error("%s is missing or corrupt.\n", _file_checkpoints[j]->filename().data());
+            throw TaskAbortException();
+        }
+        _file_checkpoints[j]->free_buffer();
+        if (j == 0)
+            _accumulator->x() = state.X();
+        P.emplace_back(gw());
+        P.back() = state.X();
+    }
+
+    // The challenge depends on the result, it is not known before the squarings are done.
+    hash_challenge(_gwstate->fingerprint, _accumulator->x(), _accumulator->y(), _T, _challenge);
+    Giant q;
+    q = 1;
+    q <<= _T;
+    q = q/_challenge;
+
+    // pi = prod(P[j]^q[j]), q[j] are the bits of q from j*s to (j+1)*s. The windows of all q[j] are processed together, from the top.
+    GWNum A(gw());
+    bool A_set = _accumulator->window() > 0;
+    if (A_set)
+        A = _accumulator->pi();
+    std::vector<GWNum> buckets;
+    for (d = 1; d < (1 << _k); d++)
+        buckets.emplace_back(gw());
+    std::vector<bool> used(buckets.size());
+    GWNum S(gw());
+    GWNum F(gw());
+    _last_write = std::chrono::system_clock::now();
+    for (i = _accumulator->window(); i < _windows; i++)
+    {
+        bool abort = Task::abort_flag();
+        if (i > _accumulator->window() && (abort || std::chrono::duration<double>(std::chrono::system_clock::now() - _last_write).count() >= Task::DISK_WRITE_TIME))
+        {
+            Giant pi;
+            pi = A;
+            _accumulator->set(i, pi);
+            _file_accumulator->write(*_accumulator);
+            _file_accumulator->free_buffer();
+            _last_write = std::chrono::system_clock::now();
+        }
+        if (abort)
+            throw TaskAbortException();
+
+        if (A_set)
+            for (t = 0; t < _k; t++)
+                gw().square(A, A, 0);
+        std::fill(used.begin(), used.end(), false);
+        for (j = 0; j < _count; j++)
+        {
+            int bit = j*_windows*_k + (_windows - 1 - i)*_k;
+            for (d = 0, t = _k - 1; t >= 0; t--)
+                d = 2*d + (bit + t < q.bitlen() && q.bit(bit + t) ? 1 : 0);
+            if (d == 0)
+                continue;
+            if (used[d - 1])
+                gw().mul(P[j], buckets[d - 1], buckets[d - 1], 0);
+            else
+                buckets[d - 1] = P[j];
+            used[d - 1] = true;
+        }
+
+        // prod(bucket[d]^d) = prod(bucket[d]*...*bucket[max])
+        bool S_set = false;
+        bool F_set = false;
+        for (d = (int)buckets.size() - 1; d >= 0; d--)
+        {
+            if (used[d] && S_set)
+                gw().mul(buckets[d], S, S, 0);
+            else if (used[d])
+                S = buckets[d];
+            S_set |= used[d];
+            if (S_set && F_set)
+                gw().mul(S, F, F, 0);
+            else if (S_set)
+                F = S;
+            F_set |= S_set;
+        }
+        if (F_set && A_set)
+            gw().mul(F, A, A, 0);
+        else if (F_set)
+            A = F;
+        A_set |= F_set;
+    }
+    GWASSERT(A_set);
+
+    Giant pi;
+    pi = A;
+    _accumulator->set(_windows, pi);
+    _file_accumulator->write(*_accumulator);
+    _file_accumulator->free_buffer();
+}
+
+void WesolowskiExp::execute()
+{
+    int i, next_point;
+
+    GWASSERT(state() != nullptr);
+    if (_file_accumulator == nullptr)
+    {
+        _file_accumulator = _file->add_child("w", _file->fingerprint());
+        for (i = 0; i < _count; i++)
+            _file_checkpoints.push_back(_file_accumulator->add_child(std::to_string(i), _file->fingerprint()));
+    }
+    i = state()->iteration();
+    if (i < 30)
+        gwset_carefully_count(gw().gwdata(), 30 - i);
+
+    int s = _windows*_k;
+    for (next_point = 0; next_point < _points.size() && i >= _points[next_point]; next_point++);
+    // Stopped after the squarings but before the certificate was written.
+    if (i >= _T)
+        finish(i);
+    for (; next_point < _points.size(); next_point++)
+    {
+        while (i < _points[next_point])
+        {
+            if (i < _T && i%s == 0)
+                checkpoint(i/s);
+            int end = i < _T ? std::min(_points[next_point], (i/s + 1)*s) : _points[next_point];
+            square_run<false, State>(i, end, X());
+            if (i != _points[next_point])
+                commit_execute<State>(i, X());
+        }
+        if (i == _T)
+            finish(i);
+        commit_point(next_point, i);
+    }
+    commit_tail(i);
+
+    done();
+}
+
 void StrongCheckMultipointExp::Gerbicz_params(int iters, double log2b, int& L, int &L2)
 {
     int i;
@@ -348,16 +849,13 @@ double StrongCheckMultipointExp::cost()
     else if (smooth())
     {
         double log2b = log2(b());
-        int W;
-        for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + log2b*_L*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + log2b*_L*(1 + 1/(W + 2.0)); W++);
-        return n/_L + (n/_L + n/_L2)*((1 << (W - 1)) + log2b*_L*(1 + 1/(W + 1.0)));
+        return n/_L + (n/_L + n/_L2)*ExpRecoding::estimate(log2b*_L, table_size(log2b*_L));
     }
     else
     {
-        int len = _exp.bitlen() - 1;
-        int W;
-        for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + len*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + len*(1 + 1/(W + 2.0)); W++);
-        return (1 << (W - 1)) + n*(1 + 1/(W + 1.0)) + n/_L + n/_L2*(_L + (_L + std::log2(_L2/_L))*(1 + 1/(W + 1.0)));
+        ExpRecoding& recoding = this->recoding();
+        double density = recoding.digits().size()/(_exp.bitlen() - 1.0);
+        return recoding.cost() + n/_L + n/_L2*(_L + (_L + std::log2(_L2/_L))*(1 + density));
     }
 }
 
@@ -367,18 +865,44 @@ void StrongCheckMultipointExp::init(InputNum* input, GWState* gwstate, File* fil
     GWASSERT(!smooth() || (_x0 == 0 && _X0.empty()));
     GWASSERT(_x0 <= (uint32_t)gwstate->maxmulbyconst);
     GWASSERT(_points.back() > 0);
-    BaseExp::init(input, gwstate, file, read_state<StrongCheckState>(file), logging, _points.back() + (!_tail.empty() ? 1 : 0));
+    BaseExp::init(input, gwstate, file, read_state<StrongCheckState>(file), logging, _points.back() + (has_tail() ? 1 : 0));
     _state_update_period = MULS_PER_STATE_UPDATE;
     if (smooth() && b() != 2)
         _state_update_period = (int)(_state_update_period/log2(b()));
     _logging->info("Gerbicz%s check enabled, L2 = %d*%d.\n", !smooth() ? "-Li" : "", _L, _L2/_L);
     _logging->report_param("L", _L);
     _logging->report_param("L2", _L2);
+    if (_adaptive && !((smooth() && b() == 2) || (!smooth() && _x0 > 0)))
+        _adaptive = false;
+    if (_adaptive)
+        _logging->info("adaptive L2 enabled.\n");
+    _L2_adaptive = _L2;
+    _adaptive_passes = 0;
     if (_error_check)
         _logging->info("max roundoff check enabled.\n");
     _file_recovery = file_recovery;
     _state_recovery.reset();
-    State* state_recovery = read_state<State>(file_recovery);
+    _recovery_failures = 0;
+    State* state_recovery = nullptr;
+    if (_ring && file_recovery != nullptr)
+    {
+        // Each entry carries its own hash, a damaged entry is dropped on read. The file hash would reject the whole ring.
+        file_recovery->hash = false;
+        _ring->clear();
+        if (file_recovery->read(*_ring) && _ring->size() > 0)
+        {
+            state_recovery = _ring->find(INT_MAX);
+            if (state_recovery->iteration() != _ring->iteration())
+            {
+                _logging->warning("newest recovery point is corrupt, using %.1f%%.\n", 100.0*state_recovery->iteration()/iterations());
+                _ring->truncate(state_recovery->iteration());
+                file_recovery->write(*_ring);
+            }
+        }
+        _logging->info("keeping %d recovery points.\n", _ring->size() > 0 ? _ring->size() : 1);
+    }
+    if (state_recovery == nullptr)
+        state_recovery = read_state<State>(file_recovery);
     if (state_recovery != nullptr)
         init_state(state_recovery);
 }
@@ -403,10 +927,19 @@ void StrongCheckMultipointExp::init_state(State* state)
         _logging->info("restarting at %.1f%%.\n", 100.0*_state->iteration()/iterations());
 }
 
-void StrongCheckMultipointExp::StrongCheckState::set(int iteration, int recovery, arithmetic::GWNum& X, arithmetic::GWNum& D)
+void StrongCheckMultipointExp::StrongCheckState::set(int iteration, int recovery, arithmetic::GWNum& X, arithmetic::GWNum& D, bool lean)
 {
     TaskState::set(iteration);
     _recovery = recovery;
+    if (lean)
+    {
+        // No GWNum copies, the snapshot goes straight to Giant.
+        _gwX.reset();
+        _gwD.reset();
+        _X = X;
+        _D = D;
+        return;
+    }
     if (!_gwX)
         _gwX.reset(new GWNum(X.arithmetic()));
     *_gwX = X;
@@ -415,9 +948,85 @@ void StrongCheckMultipointExp::StrongCheckState::set(int iteration, int recovery
     *_gwD = D;
 }
 
+void StrongCheckMultipointExp::RecoveryRing::push(State& state)
+{
+    _states.emplace_front(new State(state.iteration(), state.X()));
+    while (_states.size() > _size)
+        _states.pop_back();
+    TaskState::set(state.iteration());
+}
+
+void StrongCheckMultipointExp::RecoveryRing::truncate(int iteration)
+{
+    while (!_states.empty() && _states.front()->iteration() > iteration)
+        _states.pop_front();
+    TaskState::set(iteration);
+}
+
+StrongCheckMultipointExp::State* StrongCheckMultipointExp::RecoveryRing::find(int iteration_below)
+{
+    for (auto it = _states.begin(); it != _states.end(); it++)
+        if ((*it)->iteration() < iteration_below)
+            return new State((*it)->iteration(), (*it)->X());
+    return nullptr;
+}
+
+bool StrongCheckMultipointExp::RecoveryRing::read(Reader& reader)
+{
+    int count;
+    _states.clear();
+    if (!TaskState::read(reader) || !reader.read(count))
+        return false;
+    for (int i = 0; i < count; i++)
+    {
+        int iteration;
+        int hash;
+        Giant X;
+        if (!reader.read(iteration) || !reader.read(hash) || !reader.read(X))
+            break;
+        std::unique_ptr<State> state(new State(iteration, std::move(X)));
+        if (hash == RecoveryRing::hash(*state) && _states.size() < _size)
+            _states.push_back(std::move(state));
+    }
+    return true;
+}
+
+void StrongCheckMultipointExp::RecoveryRing::write(Writer& writer)
+{
+    TaskState::write(writer);
+    writer.write((int)_states.size());
+    for (auto it = _states.begin(); it != _states.end(); it++)
+    {
+        writer.write((*it)->iteration());
+        writer.write(hash(**it));
+        writer.write((*it)->X());
+    }
+}
+
+int StrongCheckMultipointExp::RecoveryRing::hash(State& state)
+{
+    MD5_CTX context;
+    uint32_t digest[4];
+    int iteration = state.iteration();
+    MD5Init(&context);
+    MD5Update(&context, (unsigned char *)&iteration, 4);
+    MD5Update(&context, (unsigned char *)state.X().data(), state.X().size()*4);
+    MD5Final((unsigned char *)digest, &context);
+    return (int)digest[0];
+}
+
 void StrongCheckMultipointExp::write_state()
 {
-    if (_file_recovery != nullptr && _state_recovery && !_state_recovery->is_written())
+    if (_file_recovery != nullptr && _state_recovery && _ring)
+    {
+        if (_ring->size() == 0 || _ring->iteration() != _state_recovery->iteration())
+        {
+            _ring->push(*_state_recovery);
+            _file_recovery->write(*_ring);
+            _state_recovery->set_written();
+        }
+    }
+    else if (_file_recovery != nullptr && _state_recovery && !_state_recovery->is_written())
         _file_recovery->write(*_state_recovery);
     if (state_check() != nullptr)
     {
@@ -445,7 +1054,7 @@ void StrongCheckMultipointExp::setup()
         _R.reset(new GWNum(gw()));
     if (!_D)
         _D.reset(new GWNum(gw()));
-    if (state_check() != nullptr)
+    if (state_check() != nullptr && !_lean)
     {
         if (!state_check()->gwX())
         {
@@ -525,11 +1134,19 @@ void StrongCheckMultipointExp::execute()
     else
     {
         i = state_check()->iteration();
-        X() = *state_check()->gwX();
-        D() = *state_check()->gwD();
+        if (state_check()->gwX())
+            X() = *state_check()->gwX();
+        else
+            X() = state_check()->X();
+        if (state_check()->gwD())
+            D() = *state_check()->gwD();
+        else
+            D() = state_check()->D();
     }
     if (i < 30)
         gwset_carefully_count(gw().gwdata(), 30 - i);
+    std::vector<std::pair<int, std::string>> interim_pending;
+    _interim_next = _interim != nullptr ? _interim->next(state()->iteration(), iterations()) : INT_MAX;
 
     for (next_point = 0; next_point < _points.size() && state()->iteration() >= abs(_points[next_point]); next_point++);
     while (next_point < _points.size())
@@ -537,6 +1154,17 @@ void StrongCheckMultipointExp::execute()
         for (next_check = next_point; _points[next_check] < 0; next_check++);
         int L = _L;
         int L2 = _L2;
+        // A grown block takes in only the negative points, a positive point is a restart state and must be checked first.
+        if (_adaptive)
+        {
+            L2 = _L2_adaptive;
+            if (_points[next_check] - state()->iteration() >= L)
+            {
+                L2 = std::min(L2, _points[next_check] - state()->iteration());
+                L2 -= L2%L;
+            }
+        }
+        auto block_start = std::chrono::system_clock::now();
         while ((_points[next_check] - state()->iteration()) < L2 && L > 1)
         {
             if (L == 3)
@@ -554,25 +1182,72 @@ void StrongCheckMultipointExp::execute()
             D() = R();
             _state.reset(new TaskState(5));
             _state->set(i);
+            interim_pending.clear();
+            _interim_next = _interim != nullptr ? _interim->next(i, iterations()) : INT_MAX;
         }
         else
             for (; next_point < next_check && i >= abs(_points[next_point]); next_point++);
 
-        if ((smooth() && b() == 2) || (!smooth() && _x0 > 0))
+        if (((smooth() && b() == 2) || (!smooth() && _x0 > 0)) && !_reference_kernel)
         {
-            for (j = i - state()->iteration(); j < L2; j++, i++, commit_execute<StrongCheckState>(i, state()->iteration(), X(), D()))
+            if (!smooth())
+                init_exp_bits();
+            int recovery = state()->iteration();
+            for (j = i - recovery; j < L2; j = i - recovery, commit_execute<StrongCheckState>(i, recovery, X(), D(), _lean))
             {
-                gw().square(X(), X(), (!smooth() && _exp.bit(len - i - 1) ? GWMUL_MULBYCONST : 0) | GWMUL_STARTNEXTFFT_IF(!is_last(i) && i + 1 != abs(_points[next_point]) && j + 1 != L2));
-                if (j + 1 != L2 && i + 1 == -_points[next_point])
+                int end = recovery + std::min(L2, (j/L + 1)*L);
+                if (next_point < next_check && abs(_points[next_point]) < end)
+                    end = abs(_points[next_point]);
+                if (_interim_next < end)
+                    end = _interim_next;
+                if (smooth())
+                    square_run<false, StrongCheckState>(i, end, recovery, X(), D(), _lean);
+                else
+                    square_run<true, StrongCheckState>(i, end, recovery, X(), D(), _lean);
+                j = i - recovery;
+                if (i == _interim_next)
+                {
+                    tmp = X();
+                    interim_pending.emplace_back(i, tmp.to_res64());
+                    _interim_next = _interim->next(i, iterations());
+                }
+                if (j != L2 && next_point < next_check && i == abs(_points[next_point]))
                 {
                     check();
-                    _logging->progress().update(-_points[next_point]/(double)iterations(), (int)_gwstate->handle.fft_count/2);
+                    _logging->progress().update(i/(double)iterations(), (int)_gwstate->handle.fft_count/2);
                     _logging->progress_save();
                     tmp = X();
                     if (_on_point != nullptr)
                         _on_point(next_point, tmp);
-                    _logging->progress().update(-_points[next_point]/(double)iterations(), (int)_gwstate->handle.fft_count/2);
-                    set_state<StrongCheckState>(i + 1, state()->iteration(), X(), D());
+                    _logging->progress().update(i/(double)iterations(), (int)_gwstate->handle.fft_count/2);
+                    set_state<StrongCheckState>(i, recovery, X(), D(), _lean);
+                    next_point++;
+                }
+                if (j != L2 && j%L == 0)
+                    gw().mul(X(), D(), D(), is_last(i - 1) ? GWMUL_PRESERVE_S1 : GWMUL_FFT_S1 | GWMUL_STARTNEXTFFT_IF(j + L != L2));
+            }
+        }
+        else if ((smooth() && b() == 2) || (!smooth() && _x0 > 0))
+        {
+            for (j = i - state()->iteration(); j < L2; j++, i++, commit_execute<StrongCheckState>(i, state()->iteration(), X(), D(), _lean))
+            {
+                gw().square(X(), X(), (!smooth() && _exp.bit(len - i - 1) ? GWMUL_MULBYCONST : 0) | GWMUL_STARTNEXTFFT_IF(!is_last(i) && i + 1 != abs(_points[next_point]) && j + 1 != L2 && i + 1 != _interim_next));
+                if (i + 1 == _interim_next)
+                {
+                    tmp = X();
+                    interim_pending.emplace_back(i + 1, tmp.to_res64());
+                    _interim_next = _interim->next(i + 1, iterations());
+                }
+                if (j + 1 != L2 && next_point < next_check && i + 1 == abs(_points[next_point]))
+                {
+                    check();
+                    _logging->progress().update((i + 1)/(double)iterations(), (int)_gwstate->handle.fft_count/2);
+                    _logging->progress_save();
+                    tmp = X();
+                    if (_on_point != nullptr)
+                        _on_point(next_point, tmp);
+                    _logging->progress().update((i + 1)/(double)iterations(), (int)_gwstate->handle.fft_count/2);
+                    set_state<StrongCheckState>(i + 1, state()->iteration(), X(), D(), _lean);
                     next_point++;
                 }
                 if (j + 1 != L2 && (j + 1)%L == 0)
@@ -582,7 +1257,7 @@ void StrongCheckMultipointExp::execute()
         else if (smooth())
         {
             GWASSERT((i - state()->iteration())%L == 0);
-            for (j = i - state()->iteration(); j < L2; j += L, i += L, commit_execute<StrongCheckState>(i, state()->iteration(), X(), D()))
+            for (j = i - state()->iteration(); j < L2; j += L, i += L, commit_execute<StrongCheckState>(i, state()->iteration(), X(), D(), _lean))
             {
                 if (last_power != L)
                 {
@@ -600,7 +1275,7 @@ void StrongCheckMultipointExp::execute()
                     if (_on_point != nullptr)
                         _on_point(next_point, tmp);
                     _logging->progress().update(-_points[next_point]/(double)iterations(), (int)_gwstate->handle.fft_count/2);
-                    set_state<StrongCheckState>(i + L, state()->iteration(), X(), D());
+                    set_state<StrongCheckState>(i + L, state()->iteration(), X(), D(), _lean);
                     next_point++;
                 }
                 if (j + L != L2)
@@ -610,7 +1285,7 @@ void StrongCheckMultipointExp::execute()
         else if(!_X0.empty())
         {
             GWASSERT((i - state()->iteration())%L == 0);
-            for (j = i - state()->iteration(); j < L2; j += L, i += L, commit_execute<StrongCheckState>(i, state()->iteration(), X(), D()))
+            for (j = i - state()->iteration(); j < L2; j += L, i += L, commit_execute<StrongCheckState>(i, state()->iteration(), X(), D(), _lean))
             {
                 if (_points[next_point] < 0 && i + L >= -_points[next_point])
                 {
@@ -622,7 +1297,7 @@ void StrongCheckMultipointExp::execute()
                     if (_on_point != nullptr)
                         _on_point(next_point, tmp);
                     _logging->progress().update(-_points[next_point]/(double)iterations(), (int)_gwstate->handle.fft_count/2);
-                    set_state<StrongCheckState>(-_points[next_point], state()->iteration(), X(), D());
+                    set_state<StrongCheckState>(-_points[next_point], state()->iteration(), X(), D(), _lean);
                     slide(_exp, -_points[next_point], i + L, false);
                     next_point++;
                 }
@@ -634,16 +1309,17 @@ void StrongCheckMultipointExp::execute()
         }
         check();
         _logging->progress().update(i/(double)iterations(), (int)_gwstate->handle.fft_count/2);
-        if (next_point != next_check)
+        if (next_point != next_check && abs(_points[next_point]) < i)
         {
             _logging->error("point missed, invalid parameters.\n");
             throw TaskAbortException();
         }
 
         _logging->debug("performing Gerbicz%s check at %d,%d, L2 = %d*%d.\n", !smooth() ? "-Li" : "", next_check, i, L, L2/L);
-        GWNum T(D());
+        GWScratch T(*_gwstate);
+        *T = D();
         gw().carefully().mul(X(), D(), D(), 0);
-        swap(T, X());
+        swap(*T, X());
         if ((smooth() && b() == 2) || !smooth())
         {
             for (j = 0; j < L; j++)
@@ -668,46 +1344,70 @@ void StrongCheckMultipointExp::execute()
                 _exp.arithmetic().substr(_exp, len - state()->iteration() - j*L - L, L, tmp2);
             if (tmp != 0)
             {
-                GWNum TX(gw());
+                GWScratch TX(*_gwstate);
                 if (!_X0.empty())
                 {
-                    TX = X0;
-                    swap(TX, X());
+                    *TX = X0;
+                    swap(*TX, X());
                     //GWArithmetic* tmpgw = _gw;
                     //_gw = &gw().carefully();
                     slide(tmp, 0, tmp.bitlen() - 1, false);
                     //_gw = tmpgw;
-                    swap(TX, X());
+                    swap(*TX, X());
                 }
                 if (_x0 > 0)
                 {
-                    TX = _x0;
+                    *TX = _x0;
                     for (l = tmp.bitlen() - 1, j = 0; j < l; j++)
-                        gw().carefully().square(TX, TX, tmp.bit(l - j - 1) ? GWMUL_MULBYCONST : 0);
+                        gw().carefully().square(*TX, *TX, tmp.bit(l - j - 1) ? GWMUL_MULBYCONST : 0);
                 }
-                gw().carefully().mul(TX, X(), X(), 0);
+                gw().carefully().mul(*TX, X(), X(), 0);
             }
         }
         gw().carefully().mul(R(), X(), X(), 0);
         gw().carefully().sub(X(), D(), X(), 0);
-        swap(T, X());
-        if (T != 0 || D() == 0)
+        swap(*T, X());
+        if (*T != 0 || D() == 0)
         {
             _logging->error("Gerbicz%s check failed at %.1f%%.\n", !smooth() ? "-Li" : "", 100.0*i/iterations());
             if (_file != nullptr)
                 _file->clear();
             _state.reset(new TaskState(5));
             _state->set(_state_recovery->iteration());
+            _recovery_failures++;
+            if (_adaptive && _L2_adaptive > _L)
+            {
+                _L2_adaptive /= 2;
+                _L2_adaptive = std::max(_L, _L2_adaptive - _L2_adaptive%_L);
+                _adaptive_passes = 0;
+                _logging->debug("L2 decreased to %d*%d.\n", _L, _L2_adaptive/_L);
+                _logging->report_param("L2", _L2_adaptive);
+            }
+            State* state_older;
+            if (_ring && _recovery_failures >= RING_ROLLBACK_FAILURES && (state_older = _ring->find(_state_recovery->iteration())) != nullptr)
+            {
+                _logging->warning("rolling back to the previous recovery point.\n");
+                _ring->truncate(state_older->iteration());
+                _file_recovery->write(*_ring);
+                init_state(state_older);
+                _recovery_failures = 0;
+            }
             _restart_op = _recovery_op;
             throw TaskRestartException();
         }
 
+        for (auto& res64 : interim_pending)
+            _interim->emit(res64.first, res64.second, *_logging);
+        interim_pending.clear();
+        if (_interim_next <= i)
+            interim(i, X());
+
         R() = X();
         D() = X();
         if (!_tmp_state_recovery)
             _tmp_state_recovery.reset(new State());
         _tmp_state_recovery->set(i, R());
-        if (i == _points[next_check])
+        if (next_point < _points.size() && i == abs(_points[next_point]))
         {
             if (_on_point != nullptr)
             {
@@ -727,10 +1427,22 @@ void StrongCheckMultipointExp::execute()
         on_state();
         _recovery_op = _restart_op;
         _restart_count = 0;
+        _recovery_failures = 0;
+        if (_adaptive && L2 == _L2_adaptive && ++_adaptive_passes >= ADAPTIVE_GROW_PASSES)
+        {
+            _adaptive_passes = 0;
+            double block_time = std::chrono::duration<double>(std::chrono::system_clock::now() - block_start).count();
+            if (block_time*2 < Task::DISK_WRITE_TIME && _L2_adaptive*2 <= iterations())
+            {
+                _L2_adaptive *= 2;
+                _logging->debug("L2 increased to %d*%d.\n", _L, _L2_adaptive/_L);
+                _logging->report_param("L2", _L2_adaptive);
+            }
+        }
     }
     if (i < iterations())
     {
-        D() = _tail;
+        D() = tail();
         gw().carefully().mul(D(), R(), R(), 0);
         i++;
         tmp = R();
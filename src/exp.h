@@ -1,6 +1,11 @@
 #pragma once
 
 #include <functional>
+#include <cmath>
+#include <climits>
+#include <deque>
+#include <map>
+#include <future>
 #include "arithmetic.h"
 #include "group.h"
 #include "integer.h"
@@ -8,6 +13,42 @@
 #include "task.h"
 #include "file.h"
 
+// Scratch GWNums of a GWState, reused across checks and tasks. Declared after the GWState by the thread that runs its tasks,
+// the pool frees the numbers in done() and on the exception paths in its destructor.
+class GWScratchPool
+{
+public:
+    GWScratchPool(arithmetic::GWState& gwstate);
+    ~GWScratchPool();
+
+    // Frees the scratch numbers of gwstate, then calls gwstate.done().
+    static void done(arithmetic::GWState& gwstate);
+
+private:
+    friend class GWScratch;
+    arithmetic::GWState& _gwstate;
+    std::vector<std::unique_ptr<arithmetic::GWNum>> _free;
+    GWScratchPool* _outer;
+
+    static thread_local GWScratchPool* _current;
+};
+
+// Scratch GWNum leased from the pool of the GWState, a plain GWNum if the thread has no pool for it.
+class GWScratch
+{
+public:
+    GWScratch(arithmetic::GWState& gwstate);
+    GWScratch(GWScratch&& scratch) : _pool(scratch._pool), _X(std::move(scratch._X)) { }
+    ~GWScratch();
+
+    arithmetic::GWNum& operator*() { return *_X; }
+    arithmetic::GWNum* operator->() { return _X.get(); }
+
+private:
+    GWScratchPool* _pool = nullptr;
+    std::unique_ptr<arithmetic::GWNum> _X;
+};
+
 class BaseExp : public InputTask
 {
 public:
@@ -40,7 +81,9 @@ public:
     bool smooth() { return _smooth; }
     arithmetic::Giant& b() { return _smooth ? _exp : *(arithmetic::Giant*)nullptr; }
     arithmetic::Giant& exp() { return _exp; }
-    arithmetic::Giant& tail() { return _tail; }
+    arithmetic::Giant& tail() { if (_tail_async.valid()) _tail = _tail_async.get(); return _tail; }
+    bool has_tail() { return !_tail.empty() || _tail_async.valid(); }
+    void set_tail_async(std::future<arithmetic::Giant>&& tail) { _tail_async = std::move(tail); }
     arithmetic::Giant& X0() { return !_smooth ? _X0 : *(arithmetic::Giant*)nullptr; }
     uint32_t x0() { return !_smooth ? _x0 : 0; }
 
@@ -51,6 +94,7 @@ protected:
     bool _smooth;
     arithmetic::Giant _exp;
     arithmetic::Giant _tail;
+    std::future<arithmetic::Giant> _tail_async;
     arithmetic::Giant _X0;
     uint32_t _x0 = 0;
 };
@@ -91,15 +135,64 @@ public:
         init(input, gwstate, logging);
     }
 
-    double cost() override { return _exp.bitlen()*1.5; }
+    double cost() override;
+
+    static const int CHECKED_MIN_BITLEN = 65536;
+    static const int CHECKED_COUNT = 16;
 
 protected:
     void init(InputNum* input, arithmetic::GWState* gwstate, Logging* logging);
     void execute() override;
+    void execute_checked();
     void setup() override { }
     void release() override { }
 };
 
+class InterimResidues
+{
+public:
+    // The residues depend on the mode (base, exponentiation path and exponent), only those of the same mode are compared.
+    InterimResidues(int interval, int percent, bool pow2, const std::string& mode) : _interval(interval), _percent(percent), _pow2(pow2), _mode(mode) { }
+
+    bool load(const std::string& filename);
+    int next(int iteration, int iterations);
+    void emit(int iteration, const std::string& res64, Logging& logging);
+
+private:
+    int _interval;
+    int _percent;
+    bool _pow2;
+    std::string _mode;
+    std::map<int, std::string> _expected;
+};
+
+// Fractional-window recoding of an exponent into odd digits not exceeding 2*table_size - 1.
+class ExpRecoding
+{
+public:
+    struct Digit
+    {
+        int bit;    // lowest bit of the window
+        int width;
+        int value;
+    };
+
+    ExpRecoding(const arithmetic::Giant& exp, int hi, int lo, int table_size);
+
+    std::vector<Digit>& digits() { return _digits; }
+    int table_size() { return _table_size; }
+    double cost() { return _table_size + (_hi - _lo + 1) + (double)_digits.size(); }
+
+    static int optimal_table_size(double len, int W, int max_size);
+    static double estimate(double len, int table_size) { return table_size + len*(1 + 1/(std::log2(2.0*table_size) + 1)); }
+
+private:
+    int _hi;
+    int _lo;
+    int _table_size;
+    std::vector<Digit> _digits;
+};
+
 class MultipointExp : public BaseExp
 {
 public:
@@ -157,7 +250,11 @@ public:
     double cost() override;
     int _W = 5;
     int _max_size = -1;
+    virtual void set_max_size(int max_size) { _max_size = max_size; }
     std::vector<int>& points() { return _points; }
+    void set_interim(InterimResidues* interim) { _interim = interim; }
+    // The per-iteration loops without the batched squaring kernels, for comparison in tests.
+    void set_reference_kernel(bool value) { _reference_kernel = value; }
 
 protected:
     void init(InputNum* input, arithmetic::GWState* gwstate, File* file, Logging* logging);
@@ -166,17 +263,44 @@ protected:
     void execute() override;
 
     int slide_init(int len);
-    void slide(const arithmetic::Giant& exp, int start, int end, bool commit, int W = 0);
+    void slide(const arithmetic::Giant& exp, int start, int end, bool commit, int table_size = 0);
+    void slide_digits(int len, int& i, int lo, const ExpRecoding::Digit* first, const ExpRecoding::Digit* last, bool commit);
     void sliding_window(const arithmetic::Giant& exp);
+    int table_size(double len) { return ExpRecoding::optimal_table_size(len, _W, _max_size); }
+    ExpRecoding& recoding();
+    void interim(int iteration, arithmetic::GWNum& X);
+    void commit_point(int index, int iteration);
+    void commit_tail(int& iteration);
+
+    void init_exp_bits();
+    bool exp_bit(int iteration) { return (_exp_bits[iteration >> 6] >> (iteration & 63)) & 1; }
+    // Squarings from i to end, committing only where the state update needs X.
+    template<bool MulByConst, class TState, class... Args>
+    void square_run(int& i, int end, Args&&... args)
+    {
+        for (; i < end; i++)
+        {
+            bool last = is_last(i);
+            gw().square(X(), X(), (MulByConst && exp_bit(i) ? GWMUL_MULBYCONST : 0) | GWMUL_STARTNEXTFFT_IF(!last && i + 1 != end));
+            if (last && i + 1 != end)
+                commit_execute<TState>(i + 1, args...);
+        }
+    }
 
     arithmetic::GWNum& X() { return *_X; }
 
 protected:
     std::vector<int> _points;
     std::function<bool(int, arithmetic::Giant&)> _on_point;
+    InterimResidues* _interim = nullptr;
+    int _interim_next = INT_MAX;
+    bool _reference_kernel = false;
+    std::vector<uint64_t> _exp_bits;
 
     std::unique_ptr<arithmetic::GWNum> _X;
     std::vector<arithmetic::GWNum> _U;
+    int _table_size = 0;
+    std::unique_ptr<ExpRecoding> _recoding;
 };
 
 class SmoothExp : public MultipointExp
@@ -246,6 +370,64 @@ public:
     }
 };
  
+// Base 2 squarings saving checkpoints x^(2^(j*s)). After y = x^(2^T) the challenge l = H(x, y, T) is derived,
+// and pi = x^(2^T/l) is computed from the checkpoints in windows of k bits with 2^k buckets.
+class WesolowskiExp : public MultipointExp
+{
+public:
+    class Accumulator : public State
+    {
+    public:
+        static const char TYPE = 8;
+        Accumulator() { _type = TYPE; }
+        int window() { return _iteration; }
+        arithmetic::Giant& pi() { return X(); }
+        arithmetic::Giant& x() { return _x; }
+        arithmetic::Giant& y() { return _y; }
+        bool read(Reader& reader) override;
+        void write(Writer& writer) override;
+
+    private:
+        arithmetic::Giant _x;
+        arithmetic::Giant _y;
+    };
+
+public:
+    template<class B>
+    WesolowskiExp(B&& b, const std::vector<int>& points, std::function<bool(int, arithmetic::Giant&)> on_point, int T, int count) : MultipointExp(std::forward<B>(b), true, points, on_point), _T(T), _count_max(count)
+    {
+        layout();
+    }
+
+    double cost() override { return _points.back() + _windows*(_count + (2 << _k) + _k); }
+    int T() { return _T; }
+    int k() { return _k; }
+    int count() { return _count; }
+    arithmetic::Giant& challenge() { return _challenge; }
+    Accumulator* accumulator() { return _accumulator.get(); }
+    void clear_files();
+    void set_max_size(int max_size) override { _max_size = max_size; layout(); }
+
+    static void hash_challenge(uint32_t fingerprint, arithmetic::Giant& x, arithmetic::Giant& y, int T, arithmetic::Giant& l);
+
+protected:
+    void execute() override;
+    void layout();
+    void checkpoint(int index);
+    void finish(int iteration);
+
+protected:
+    int _T;
+    int _count_max;
+    int _k;
+    int _windows;
+    int _count;
+    arithmetic::Giant _challenge;
+    File* _file_accumulator = nullptr;
+    std::vector<File*> _file_checkpoints;
+    std::unique_ptr<Accumulator> _accumulator;
+};
+
 class StrongCheckMultipointExp : public MultipointExp
 {
 public:
@@ -254,7 +436,7 @@ public:
     public:
         static const int TYPE = 2;
         StrongCheckState() : TaskState(TYPE) { }
-        void set(int iteration, int recovery, arithmetic::GWNum& X, arithmetic::GWNum& D);
+        void set(int iteration, int recovery, arithmetic::GWNum& X, arithmetic::GWNum& D, bool lean);
         int recovery() { return _recovery; }
         arithmetic::Giant& X() { return _X; }
         arithmetic::Giant& D() { return _D; }
@@ -271,6 +453,26 @@ public:
         std::unique_ptr<arithmetic::GWNum> _gwD;
     };
 
+    class RecoveryRing : public TaskState
+    {
+    public:
+        static const char TYPE = 7;
+        RecoveryRing(int size) : TaskState(TYPE), _size(size) { }
+        void push(State& state);
+        void truncate(int iteration);
+        void clear() { _states.clear(); }
+        State* find(int iteration_below);
+        int size() { return (int)_states.size(); }
+        bool read(Reader& reader) override;
+        void write(Writer& writer) override;
+
+        static int hash(State& state);
+
+    private:
+        int _size;
+        std::deque<std::unique_ptr<State>> _states;
+    };
+
 public:
     template<class T>
     StrongCheckMultipointExp(T&& exp, bool smooth, const std::vector<int>& points, int L, int L2, std::function<bool(int, arithmetic::Giant&)> on_point) : MultipointExp(std::forward<T>(exp), smooth, points, on_point), _L(L), _L2(L2)
@@ -329,6 +531,9 @@ public:
     int _L2;
     double cost() override;
     static void Gerbicz_params(int iters, double log2b, int& L, int &L2);
+    void set_recovery_ring(int size) { _ring.reset(size > 1 ? new RecoveryRing(size) : nullptr); }
+    void set_adaptive(bool adaptive) { _adaptive = adaptive; }
+    void set_lean(bool lean) { _lean = lean; }
 
 protected:
     void init(InputNum* input, arithmetic::GWState* gwstate, File* file, File* file_recovery, Logging* logging);
@@ -338,10 +543,19 @@ protected:
     void execute() override;
 
 protected:
+    static const int RING_ROLLBACK_FAILURES = 2;
+    static const int ADAPTIVE_GROW_PASSES = 4;
+
     File* _file_recovery = nullptr;
     std::unique_ptr<State> _state_recovery;
     std::unique_ptr<State> _tmp_state_recovery;
     int _recovery_op = 0;
+    std::unique_ptr<RecoveryRing> _ring;
+    int _recovery_failures = 0;
+    bool _adaptive = false;
+    int _L2_adaptive = 0;
+    int _adaptive_passes = 0;
+    bool _lean = false;
 
     std::unique_ptr<arithmetic::GWNum> _R;
     std::unique_ptr<arithmetic::GWNum> _D;
@@ -1,6 +1,7 @@
 
 #include <cmath>
 #include <string.h>
+#include <stdio.h>
 
 #include "gwnum.h"
 #include "cpuid.h"
@@ -162,6 +163,19 @@ Fermat::Fermat(int type, InputNum& input, Params& params, Logging& logging, Proo
         }
         logging.progress().add_stage(_task->cost());
     }
+    else if (proof->op() == Proof::WESOLOWSKI)
+    {
+        _points.push_back(_n);
+        if (_type == PROTH || _type == POCKLINGTON)
+            _points.push_back(_n + 1);
+        _task.reset(new WesolowskiExp(input.gb(), _points, on_point, _n, proof->wesolowski_count()));
+
+        if (input.c() != 1)
+            _task_tail_simple.reset(new CarefulExp(abs(input.c() - 1)));
+        if (input.k() != 1)
+            _task_ak_simple.reset(new CarefulExp(input.gk()));
+        logging.progress().add_stage(_task->cost());
+    }
     else
     {
         if (proof->Li())
@@ -220,8 +234,30 @@ Fermat::Fermat(int type, InputNum& input, Params& params, Logging& logging, Proo
     }
 
     _task->set_error_check(!params.CheckNear || params.CheckNear.value(), params.Check && params.Check.value());
+    StrongCheckMultipointExp* taskCheck = dynamic_cast<StrongCheckMultipointExp*>(_task.get());
+    if (taskCheck != nullptr && params.StrongRing)
+        taskCheck->set_recovery_ring(params.StrongRing.value());
+    if (taskCheck != nullptr && params.StrongAdaptive)
+        taskCheck->set_adaptive(params.StrongAdaptive.value());
+    if (taskCheck != nullptr && params.StrongLean)
+        taskCheck->set_lean(params.StrongLean.value());
+    if (params.InterimIterations || params.InterimPercent || params.InterimPow2)
+    {
+        char mode[64];
+        if (_task->smooth())
+            snprintf(mode, sizeof(mode), "a=%d smooth %08x", _a, File::unique_fingerprint(input.fingerprint(), std::to_string(_n)));
+        else
+            snprintf(mode, sizeof(mode), "a=%d exp %08x", _a, File::unique_fingerprint(input.fingerprint(), std::to_string(_task->exp().bitlen()) + "." + _task->exp().to_res64()));
+        _interim.reset(new InterimResidues(params.InterimIterations ? params.InterimIterations.value() : 0, params.InterimPercent ? params.InterimPercent.value() : 0, params.InterimPow2 && params.InterimPow2.value(), mode));
+        if (!params.InterimCompareFilename.empty() && !_interim->load(params.InterimCompareFilename))
+            logging.warning("Can not read %s, interim residues will not be compared.\n", params.InterimCompareFilename.data());
+        _task->set_interim(_interim.get());
+    }
+    if (params.ReferenceKernel)
+        _task->set_reference_kernel(params.ReferenceKernel.value());
     if (_task_tail_simple)
         _task_tail_simple->set_error_check(false, true);
+    _aux_parallel = params.AuxParallel && params.AuxParallel.value();
     if (_task_ak_simple)
         _task_ak_simple->set_error_check(false, true);
     if (_task_b_simple)
@@ -262,13 +298,37 @@ void Fermat::run(InputNum& input, arithmetic::GWState& gwstate, File& file_check
     {
         if (input.c() == -1 && _a < 46341)
             tail = _a*_a;
+        else if (_aux_parallel)
+        {
+            std::unique_ptr<GWState> gwstate_aux(new GWState());
+            gwstate_aux->thread_count = 1;
+            gwstate_aux->instructions = gwstate.instructions;
+            gwstate_aux->safety_margin = gwstate.safety_margin;
+            gwstate_aux->maxmulbyconst = gwstate.maxmulbyconst;
+            gwstate_aux->fingerprint = gwstate.fingerprint;
+            input.setup(*gwstate_aux);
+            logging.debug("computing tail on %s.\n", gwstate_aux->fft_description.data());
+            _task->set_tail_async(std::async(std::launch::async, [this, &input](std::unique_ptr<GWState> gwstate_aux, Giant X0)
+                {
+                    // The handle is done on every exit path, an abort or an error in the tail would leak it otherwise.
+                    GWScratchPool scratch(*gwstate_aux);
+                    std::unique_ptr<GWState, void(*)(GWState*)> guard(gwstate_aux.get(), [](GWState* gwstate) { GWScratchPool::done(*gwstate); });
+                    Logging logging_aux(Logging::LEVEL_ERROR);
+                    _task_tail_simple->init(&input, gwstate_aux.get(), &logging_aux, std::move(X0));
+                    _task_tail_simple->run();
+                    Giant tail = std::move(_task_tail_simple->state()->X());
+                    if (input.c() < 0)
+                        tail.inv(*gwstate_aux->N);
+                    return tail;
+                }, std::move(gwstate_aux), ak));
+        }
         else
         {
             _task_tail_simple->init(&input, &gwstate, &logging, ak);
             _task_tail_simple->run();
             tail = std::move(_task_tail_simple->state()->X());
         }
-        if (input.c() < 0)
+        if (input.c() < 0 && !tail.empty())
         {
             tail.inv(*gwstate.N);
             if (input.c() == -1 && _a < 46341)
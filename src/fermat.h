@@ -24,6 +24,8 @@ public:
 
     int type() { return _type; }
     int a() { return _a; }
+    int n() { return _n; }
+    int iterations() { return _task->smooth() ? _n : _task->exp().bitlen() - 1; }
     bool success() { return _success; }
     std::string& res64() { return _res64; }
     arithmetic::Giant& result() { return _Xm1.empty() ? _task->state()->X() : _Xm1; }
@@ -48,6 +50,8 @@ protected:
     std::unique_ptr<CarefulExp> _task_ak_simple;
     std::unique_ptr<CarefulExp> _task_b_simple;
     std::unique_ptr<MultipointExp> _task;
+    std::unique_ptr<InterimResidues> _interim;
+    bool _aux_parallel = false;
 
     bool _success = false;
     std::string _res64;
@@ -2,11 +2,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <filesystem>
 #include "gwnum.h"
 #include "cpuid.h"
 
 #include "net.h"
 #include "md5.h"
+#include "support.h"
 #include "task.h"
 #include "exception.h"
 #include "fermat.h"
@@ -26,9 +29,9 @@ Writer* NetLogging::LoggingNetFile::get_writer()
     return new Writer(std::move(_buffer));
 }
 
-void NetLogging::LoggingNetFile::on_upload()
+void NetLogging::LoggingNetFile::on_upload(std::vector<char>& buffer)
 {
-    _buffer.swap(net().buffer());
+    _buffer.swap(buffer);
     _buffer.clear();
 }
 
@@ -64,22 +67,29 @@ void NetLogging::report_progress()
 {
     Logging::report_progress();
     _net.task()->time_op = progress().time_op()*1000;
+    _net.prefetch();
+    _net.heartbeat();
 }
 
 void NetLogging::progress_save()
 {
     _net.task()->progress = progress().progress_total();
     _net.task()->time = progress().time_total();
+    _net.prefetch();
 }
 
-void NetFile::on_upload()
+void NetFile::on_upload(std::vector<char>& buffer)
 {
     _uploading = true;
+    _upload_buffer = &buffer;
 }
 
-void NetFile::on_uploaded()
+void NetFile::on_uploaded(std::vector<char>& buffer)
 {
+    if (!_uploading || _upload_buffer != &buffer)
+        return;
     _uploading = false;
+    _upload_buffer = nullptr;
     if (_free_buffer)
     {
         _free_buffer = false;
@@ -90,6 +100,7 @@ void NetFile::on_uploaded()
 File* NetFile::add_child(const std::string& name, uint32_t fingerprint)
 {
     _children.emplace_back(new NetFile(_net_ctx, _filename + "." + name, fingerprint));
+    static_cast<NetFile*>(_children.back().get())->set_upload_priority(_upload_priority);
     return _children.back().get();
 }
 
@@ -100,7 +111,7 @@ Writer* NetFile::get_writer()
     _net_ctx.upload_cancel(this);
     if (_uploading)
     {
-        _buffer.swap(_net_ctx.buffer());
+        _buffer.swap(*_upload_buffer);
         _uploading = false;
     }
     Writer* writer = new Writer(std::move(_buffer));
@@ -117,56 +128,39 @@ void NetFile::read_buffer()
     }
     if (!_buffer.empty())
         return;
+    if (_net_ctx.cache_read(*this))
+        return;
 
     boost::optional<std::string> md5;
-    std::string str_data;
-
-    // Run our example in a lambda co-routine
-    auto done = _net_ctx.client()->ProcessWithPromiseT<bool>([&](Context& ctx) {
-        // This is the co-routine, running in a worker-thread
+    std::string md5hash;
+    if (!_net_ctx.fetched(*this, md5, md5hash))
+    {
+        // Run our example in a lambda co-routine
+        auto done = _net_ctx.client()->ProcessWithPromiseT<bool>([&](Context& ctx) {
+            // This is the co-routine, running in a worker-thread
 
-        while (true)
             try
             {
-                // Construct a request to the server
-                auto reply = RequestBuilder(ctx)
-                    .Get(_net_ctx.url() + "llr/" + _net_ctx.task_id() + "/" + filename())
-                    .Argument("workerID", _net_ctx.worker_id())
-
-                    // Send the request
-                    .Execute();
-
-                md5 = reply->GetHeader("MD5");
-                str_data = reply->GetBodyAsString();
-
-                return true;
-            }
-            catch (const HttpNotFoundException&) {
-                //clog << "No file." << endl;
-                str_data.clear();
-                return true;
+                _net_ctx.download(ctx, _net_ctx.task_id(), filename(), _buffer, md5, md5hash);
             }
             catch (const HttpForbiddenException&) {
                 //clog << "No task." << endl;
-                Task::abort();
+                _net_ctx.abort_task();
                 return false;
             }
-            catch (const std::exception& ex) {
-                std::clog << "File " << filename() << " download failed: " << ex.what() << std::endl;
-                ctx.Sleep(boost::posix_time::microseconds(15000000));
-                continue;
-            }
 
-        return true;
-        });
+            return true;
+            });
 
-    if (!done.get())
-        return;
+        if (!done.get())
+        {
+            _buffer.clear();
+            return;
+        }
+    }
 
-    if (hash && !str_data.empty() && md5)
+    if (hash && !_buffer.empty() && md5)
     {
-        char md5hash[33];
-        md5_raw_input(md5hash, (unsigned char*)str_data.data(), (int)str_data.size());
         _md5hash = md5hash;
         if (md5.get() != _md5hash)
         {
@@ -174,22 +168,25 @@ void NetFile::read_buffer()
             return;
         }
     }
-
-    _buffer.insert(_buffer.end(), str_data.begin(), str_data.end());
+    _net_ctx.cache_write(*this, _buffer);
 }
 
 void NetFile::commit_writer(Writer& writer)
 {
+    _net_ctx.cache_write(*this, writer.buffer());
     std::lock_guard<std::mutex> lock(_net_ctx.upload_mutex());
     _free_buffer = false;
     if (_uploading)
     {
-        _buffer.swap(_net_ctx.buffer());
+        _buffer.swap(*_upload_buffer);
         _uploading = false;
     }
     if (hash)
-        _md5hash = writer.hash_str();
+        _md5hash = !_commit_md5hash.empty() ? _commit_md5hash : writer.hash_str();
+    _commit_md5hash.clear();
     _buffer = std::move(writer.buffer());
+    if (_upload_priority == PRIORITY_CHECKPOINT && _net_ctx.upload_defer(this))
+        return;
     _net_ctx.upload(this);
 }
 
@@ -203,7 +200,7 @@ void NetFile::free_buffer()
     }
     if (_uploading)
     {
-        _buffer.swap(_net_ctx.buffer());
+        _buffer.swap(*_upload_buffer);
         _uploading = false;
     }
     _free_buffer = false;
@@ -216,11 +213,12 @@ void NetFile::clear(bool recursive)
     _net_ctx.upload_cancel(this);
     if (_uploading)
     {
-        _buffer.swap(_net_ctx.buffer());
+        _buffer.swap(*_upload_buffer);
         _uploading = false;
     }
     std::vector<char>().swap(_buffer);
     _md5hash.clear();
+    _net_ctx.cache_remove(*this);
     _net_ctx.upload(this);
 }
 
@@ -228,6 +226,7 @@ File* LLR2NetFile::add_child(const std::string& name, uint32_t fingerprint)
 {
     _children.emplace_back(new LLR2NetFile(_net_ctx, _filename + "." + name, fingerprint, _type));
     _children.back()->hash = hash;
+    static_cast<NetFile*>(_children.back().get())->set_upload_priority(_upload_priority);
     return _children.back().get();
 }
 
@@ -254,143 +253,877 @@ void LLR2NetFile::commit_writer(Writer& writer)
         writer.buffer()[6] = 0;
         if (_type == BaseExp::State::TYPE)
             (*(uint32_t*)(writer.buffer().data() + 12))++;
-        writer.write((uint32_t)0);
-        uint32_t checksum = 0;
-        char* end = writer.buffer().data() + writer.buffer().size();
-        for (char* data = writer.buffer().data() + 8; data < end; data += 4)
-            checksum += *(uint32_t*)data;
-        writer.write(checksum);
-        for (int i = 0; i < 20; i++)
-            writer.write((uint32_t)0);
+        char md5hash[33];
+        llr2_checksum(writer, hash ? md5hash : nullptr);
+        if (hash)
+            _commit_md5hash = md5hash;
     }
 
     NetFile::commit_writer(writer);
 }
 
+bool NetUploader::queued(NetFile* file)
+{
+    return std::find(_queue.begin(), _queue.end(), file) != _queue.end();
+}
+
+void NetUploader::cancel(NetFile* file)
+{
+    _queue.erase(std::remove(_queue.begin(), _queue.end(), file), _queue.end());
+    for (auto& slot : _slots)
+        if (slot.file == file)
+            slot.cancelled = true;
+}
+
 bool NetContext::upload_queued(NetFile* file)
 {
-    for (auto it = _upload_queue.begin(); it != _upload_queue.end(); it++)
-        if (*it == file)
-            return true;
-    return false;
+    return _uploader.queued(file) || std::find(_upload_deferred.begin(), _upload_deferred.end(), file) != _upload_deferred.end();
 }
 
 void NetContext::upload_cancel(NetFile* file)
 {
-    auto it = _upload_queue.begin();
-    while (it != _upload_queue.end())
-        if (*it == file)
-            it = _upload_queue.erase(it);
+    _uploader.cancel(file);
+    _upload_deferred.erase(std::remove(_upload_deferred.begin(), _upload_deferred.end(), file), _upload_deferred.end());
+}
+
+// Only a file kept in the cache is held back, otherwise the deferred work would exist only in memory.
+bool NetContext::upload_defer(NetFile* file)
+{
+    if (_upload_interval <= 0 || _cache_dir.empty() || !file->cached() || std::chrono::system_clock::now() - file->upload_time() >= std::chrono::seconds(_upload_interval))
+        return false;
+    if (std::find(_upload_deferred.begin(), _upload_deferred.end(), file) == _upload_deferred.end())
+        _upload_deferred.push_back(file);
+    return true;
+}
+
+void NetContext::upload_flush(bool all)
+{
+    std::lock_guard<std::mutex> lock(upload_mutex());
+    auto it = _upload_deferred.begin();
+    while (it != _upload_deferred.end())
+        if (all || std::chrono::system_clock::now() - (*it)->upload_time() >= std::chrono::seconds(_upload_interval))
+        {
+            NetFile* file = *it;
+            it = _upload_deferred.erase(it);
+            upload(file);
+        }
         else
             it++;
 }
 
 void NetContext::upload_wait()
 {
-    std::future<void> localF;
-    {
-        std::lock_guard<std::mutex> lock(_upload_mutex);
-        localF = std::move(_uploadF);
-    }
-    if (localF.valid())
-        localF.get();
+    upload_flush(true);
+    _uploader.wait(*this);
 }
 
-void NetContext::upload(NetFile* file)
+// The computations of all slots stop on the shared abort flag, the slots resume their tasks once every one has stopped.
+void NetContext::abort_task()
 {
-    _upload_queue.push_back(file);
-    if (_uploadF.valid() || _task->aborted)
+    _task->aborted = true;
+    task_aborts++;
+    Task::abort();
+}
+
+std::atomic<int> NetContext::task_aborts(0);
+
+// Reserves the bandwidth for the next size bytes, returns the time to wait before sending them.
+boost::posix_time::time_duration NetUploader::pace(size_t size)
+{
+    if (_rate <= 0)
+        return boost::posix_time::microseconds(0);
+    auto now = std::chrono::system_clock::now();
+    if (_next < now)
+        _next = now;
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(_next - now);
+    _next += std::chrono::microseconds((int64_t)(size/_rate*1000000));
+    return boost::posix_time::microseconds(wait.count());
+}
+
+void NetContext::heartbeat()
+{
+    upload_flush(false);
+    if (_heartbeat_interval <= 0 || !_task || _task->aborted)
+        return;
+    if (std::chrono::system_clock::now() - _heartbeat_time < std::chrono::seconds(_heartbeat_interval))
+        return;
+    if (_heartbeatF.valid() && _heartbeatF.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return;
+    _heartbeat_time = std::chrono::system_clock::now();
+
+    std::string post_url = url() + "llr/hb/" + task_id();
+    std::string progress = std::to_string(_task->progress);
+    std::string time = std::to_string(_task->time);
+    std::string time_op = std::to_string(_task->time_op);
+    _heartbeatF = _client->ProcessWithPromise([this, post_url, progress, time, time_op](Context& ctx) {
+        try
+        {
+            RequestBuilder(ctx)
+                .Post(post_url)
+                .Argument("workerID", worker_id())
+                .Argument("uptime", uptime())
+                .Argument("progress", progress)
+                .Argument("time", time)
+                .Argument("time_op", time_op)
+                .Execute();
+        }
+        catch (const std::exception& ex) {
+            std::clog << "Heartbeat failed: " << ex.what() << std::endl;
+        }
+    });
+}
+
+bool NetUploader::busy(NetContext& net)
+{
+    for (auto file : _queue)
+        if (&file->net() == &net && !net.task()->aborted)
+            return true;
+    for (auto& slot : _slots)
+        if (slot.file != nullptr && &slot.file->net() == &net)
+            return true;
+    return false;
+}
+
+// Waits for the uploads of one slot, files of an aborted task are dropped.
+void NetUploader::wait(NetContext& net)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [&] { return !busy(net); });
+    _queue.erase(std::remove_if(_queue.begin(), _queue.end(), [&](NetFile* file) { return &file->net() == &net; }), _queue.end());
+}
+
+void NetUploader::done()
+{
+    _putter->CloseWhenReady(true);
+}
+
+void NetUploader::upload(NetFile* file)
+{
+    file->upload_time() = std::chrono::system_clock::now();
+    _queue.push_back(file);
+    if (file->net().task()->aborted)
         return;
+    for (auto& slot : _slots)
+        if (slot.busy && slot.file == nullptr)
+            return;
+    for (auto& slot : _slots)
+        if (!slot.busy)
+        {
+            run(slot);
+            return;
+        }
+}
+
+// The oldest file of the highest priority, skipping files whose previous version is still in flight.
+NetFile* NetUploader::next()
+{
+    _queue.erase(std::remove_if(_queue.begin(), _queue.end(), [](NetFile* file) { return file->net().task()->aborted; }), _queue.end());
+    auto next = _queue.end();
+    for (auto it = _queue.begin(); it != _queue.end(); it++)
+    {
+        if (next != _queue.end() && (*next)->upload_priority() >= (*it)->upload_priority())
+            continue;
+        bool in_flight = false;
+        for (auto& slot : _slots)
+            if (slot.file == *it)
+                in_flight = true;
+        if (!in_flight)
+            next = it;
+    }
+    if (next == _queue.end())
+        return nullptr;
+    NetFile* file = *next;
+    _queue.erase(next);
+    return file;
+}
 
-    _uploadF = _putter->ProcessWithPromise([this](Context& ctx) {
+void NetUploader::run(Slot& slot)
+{
+    slot.busy = true;
+    slot.future = _putter->ProcessWithPromise([this, &slot](Context& ctx) {
 
         NetFile* file = nullptr;
         std::string put_url;
         std::string md5;
         char* data;
         size_t size;
+        size_t offset;
+        int failures = 0;
         while (true)
         {
             if (file == nullptr)
             {
-                std::lock_guard<std::mutex> lock(_upload_mutex);
-                if (_upload_queue.empty() || _task->aborted)
+                std::lock_guard<std::mutex> lock(_mutex);
+                if ((file = next()) == nullptr)
                 {
-                    _uploadF = std::future<void>();
+                    slot.busy = false;
+                    _idle.notify_all();
                     return;
                 }
-                file = _upload_queue.front();
-                _upload_queue.pop_front();
-                put_url = url() + "llr/" + task_id() + "/" + file->filename();
+                slot.file = file;
+                slot.cancelled = false;
+                put_url = file->net().url() + "llr/" + file->net().task_id() + "/" + file->filename();
                 data = file->buffer().data();
                 size = file->buffer().size();
+                offset = 0;
+                failures = 0;
                 md5 = file->md5hash();
-                file->on_upload();
+                file->on_upload(slot.buffer);
             }
+            NetContext& net = file->net();
+            PRSTTask& task = *net.task();
 
             try
             {
-                RequestBuilder(ctx)
-                    .Put(put_url)
+                // Large files go in chunks, each with its offset and MD5, so a failure resends only the current chunk.
+                size_t chunk_size = net.chunk_size();
+                size_t count = chunk_size > 0 && size > chunk_size ? std::min(chunk_size, size - offset) : size;
+                RequestBuilder builder(ctx);
+                builder.Put(put_url)
                     .Argument("md5", md5)
-                    .Argument("workerID", worker_id())
-                    .Argument("uptime", uptime())
-                    .Argument("fft_desc", _task->fft_desc)
-                    .Argument("fft_len", _task->fft_len)
-                    .Argument("a", _task->a)
-                    .Argument("L", _task->L)
-                    .Argument("L2", _task->L2)
-                    .Argument("M", _task->M)
-                    .Argument("progress", std::to_string(_task->progress))
-                    .Argument("time", std::to_string(_task->time))
-                    .Argument("time_op", std::to_string(_task->time_op))
-                    .Body(std::unique_ptr<RequestBody>(new RequestBodyData(data, size)))
+                    .Argument("workerID", net.worker_id())
+                    .Argument("uptime", net.uptime())
+                    .Argument("fft_desc", task.fft_desc)
+                    .Argument("fft_len", task.fft_len)
+                    .Argument("a", task.a)
+                    .Argument("L", task.L)
+                    .Argument("L2", task.L2)
+                    .Argument("M", task.M)
+                    .Argument("progress", std::to_string(task.progress))
+                    .Argument("time", std::to_string(task.time))
+                    .Argument("time_op", std::to_string(task.time_op));
+                if (count < size)
+                {
+                    char chunk_md5[33];
+                    md5_raw_input(chunk_md5, (unsigned char*)data + offset, (int)count);
+                    builder.Argument("offset", offset)
+                        .Argument("size", size)
+                        .Argument("chunk_md5", std::string(chunk_md5));
+                }
+                boost::posix_time::time_duration wait;
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    wait = pace(count);
+                }
+                if (wait.total_microseconds() > 0)
+                    ctx.Sleep(wait);
+                builder.Body(std::unique_ptr<RequestBody>(new RequestBodyData(data + offset, count)))
                     .Execute();
 
-                std::lock_guard<std::mutex> lock(_upload_mutex);
-                file->on_uploaded();
-                file = nullptr;
+                failures = 0;
+                offset += count;
+                if (offset < size)
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!slot.cancelled && !task.aborted)
+                        continue;
+                }
             }
             catch (const HttpAuthenticationException&) {
                 std::clog << "Task timed out." << std::endl;
-                _task->aborted = true;
-                Task::abort();
-                std::lock_guard<std::mutex> lock(_upload_mutex);
-                file->on_uploaded();
-                file = nullptr;
+                net.abort_task();
             }
             catch (const HttpForbiddenException&) {
                 std::clog << "Task not found." << std::endl;
-                _task->aborted = true;
-                Task::abort();
-                std::lock_guard<std::mutex> lock(_upload_mutex);
-                file->on_uploaded();
-                file = nullptr;
+                net.abort_task();
             }
             catch (const std::exception& ex) {
-                std::clog << "Upload to " << put_url << " failed: " << ex.what() << std::endl;
-                ctx.Sleep(boost::posix_time::microseconds(15000000));
+                std::clog << "Upload to " << put_url << " failed at " << offset << ": " << ex.what() << std::endl;
+                ctx.Sleep(NetContext::backoff(++failures));
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!slot.cancelled && !task.aborted)
+                    continue;
             }
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            file->on_uploaded(slot.buffer);
+            std::vector<char>().swap(slot.buffer);
+            slot.file = nullptr;
+            file = nullptr;
+            _idle.notify_all();
         }
     });
 }
 
-void NetContext::done()
+std::string NetContext::cache_path(const std::string& task_id, const std::string& filename)
 {
-    _putter->CloseWhenReady(true);
+    std::string name = task_id + "." + filename;
+    std::replace(name.begin(), name.end(), '/', '_');
+    std::replace(name.begin(), name.end(), '\\', '_');
+    return _cache_dir + "/" + name;
+}
+
+// A cached file is used if the server has the same MD5, or does not have the file yet and gets it from the cache.
+bool NetContext::cache_read(NetFile& file)
+{
+    if (_cache_dir.empty() || !file.cached())
+        return false;
+    FILE* fd = fopen(cache_path(task_id(), file.filename()).data(), "rb");
+    if (fd == nullptr)
+        return false;
+    std::vector<char>& buffer = file.buffer();
+    fseek(fd, 0, SEEK_END);
+    buffer.resize(ftell(fd));
+    fseek(fd, 0, SEEK_SET);
+    MD5_CTX context;
+    MD5Init(&context);
+    bool valid = !buffer.empty();
+    for (size_t pos = 0; valid && pos < buffer.size(); pos += 1048576)
+    {
+        size_t count = std::min(buffer.size() - pos, (size_t)1048576);
+        valid = fread(buffer.data() + pos, 1, count, fd) == count;
+        MD5Update(&context, (unsigned char*)buffer.data() + pos, (unsigned int)count);
+    }
+    fclose(fd);
+    char md5hash[33];
+    md5_hex(md5hash, &context);
+
+    boost::optional<std::string> md5;
+    auto done = _client->ProcessWithPromiseT<int>([&](Context& ctx) {
+        try
+        {
+            auto reply = RequestBuilder(ctx)
+                .Head(url() + "llr/" + task_id() + "/" + file.filename())
+                .Argument("workerID", worker_id())
+                .Execute();
+            md5 = reply->GetHeader("MD5");
+            return 1;
+        }
+        catch (const HttpNotFoundException&) {
+            return 0;
+        }
+        catch (const std::exception&) {
+            return -1;
+        }
+    });
+    int status = valid ? done.get() : -1;
+    if (status < 0 || (status > 0 && (!md5 || md5.get() != md5hash)))
+    {
+        buffer.clear();
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(upload_mutex());
+    file.md5hash() = md5hash;
+    if (status == 0)
+        upload(&file);
+    return true;
+}
+
+void NetContext::cache_write(NetFile& file, std::vector<char>& buffer)
+{
+    if (_cache_dir.empty() || !file.cached())
+        return;
+    std::string filename = cache_path(task_id(), file.filename());
+    FILE* fd = fopen((filename + ".tmp").data(), "wb");
+    if (fd == nullptr)
+        return;
+    bool written = fwrite(buffer.data(), 1, buffer.size(), fd) == buffer.size();
+    fflush(fd);
+    fclose(fd);
+    if (written)
+    {
+        remove(filename.data());
+        rename((filename + ".tmp").data(), filename.data());
+    }
+    else
+        remove((filename + ".tmp").data());
+}
+
+void NetContext::cache_remove(NetFile& file)
+{
+    if (!_cache_dir.empty() && file.cached())
+        remove(cache_path(task_id(), file.filename()).data());
+}
+
+void NetContext::cache_clear(const std::string& task_id)
+{
+    if (_cache_dir.empty())
+        return;
+    std::string prefix = task_id + ".";
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(_cache_dir, ec))
+        if (entry.path().filename().string().compare(0, prefix.size(), prefix) == 0)
+            std::filesystem::remove(entry.path(), ec);
+}
+
+void NetContext::acquire(Context& ctx, PRSTTask& task)
+{
+    SerializeFromJson(task, RequestBuilder(ctx)
+        .Post(url() + "llr/new")
+        .Argument("workerID", worker_id())
+        .Argument("uptime", uptime())
+        .Argument("version", NET_PRST_VERSION "." VERSION_BUILD)
+        .Execute()
+    );
+}
+
+boost::posix_time::time_duration NetContext::backoff(int failures)
+{
+    return boost::posix_time::seconds(std::min(1 << std::min(failures, 6), 60));
+}
+
+// Downloads the file in ranges of the chunk size straight into data, resuming after network failures.
+bool NetContext::download(Context& ctx, const std::string& task_id, const std::string& filename, std::vector<char>& data, boost::optional<std::string>& md5, std::string& md5hash, int max_failures)
+{
+    int failures = 0;
+    data.clear();
+    md5hash.clear();
+    // The MD5 is updated as the data arrives, it always covers exactly the received part.
+    MD5_CTX context;
+    MD5Init(&context);
+    while (true)
+        try
+        {
+            RequestBuilder builder(ctx);
+            builder.Get(url() + "llr/" + task_id + "/" + filename)
+                .Argument("workerID", worker_id());
+            if (_chunk_size > 0)
+                builder.Header("Range", "bytes=" + std::to_string(data.size()) + "-" + std::to_string(data.size() + _chunk_size - 1));
+            else if (!data.empty())
+                builder.Header("Range", "bytes=" + std::to_string(data.size()) + "-");
+            auto reply = builder.Execute();
+
+            md5 = reply->GetHeader("MD5");
+            size_t total = 0;
+            bool partial = reply->GetResponseCode() == 206;
+            if (!partial)
+            {
+                data.clear();
+                MD5Init(&context);
+            }
+            auto range = reply->GetHeader("Content-Range");
+            if (partial && range && range.get().find('/') != std::string::npos && range.get().back() != '*')
+                total = std::stoull(range.get().substr(range.get().find('/') + 1));
+            size_t received = 0;
+            while (reply->MoreDataToRead())
+            {
+                auto buffer = reply->GetSomeData();
+                const char* chunk = boost::asio::buffer_cast<const char*>(buffer);
+                data.insert(data.end(), chunk, chunk + boost::asio::buffer_size(buffer));
+                MD5Update(&context, (unsigned char*)chunk, (unsigned int)boost::asio::buffer_size(buffer));
+                received += boost::asio::buffer_size(buffer);
+            }
+            failures = 0;
+            if (!partial || (total > 0 && data.size() >= total) || (total == 0 && (_chunk_size == 0 || received < _chunk_size)))
+            {
+                char digest[33];
+                md5_hex(digest, &context);
+                md5hash = digest;
+                return true;
+            }
+        }
+        catch (const HttpNotFoundException&) {
+            //clog << "No file." << endl;
+            data.clear();
+            return false;
+        }
+        catch (const HttpForbiddenException&) {
+            throw;
+        }
+        catch (const std::exception& ex) {
+            std::clog << "File " << filename << " download failed at " << data.size() << ": " << ex.what() << std::endl;
+            if (++failures == max_failures)
+                throw;
+            ctx.Sleep(backoff(failures));
+        }
+}
+
+// Claims the next task and downloads its number near the end of the current one.
+// The spooled results go first, the next task is claimed once they are accepted.
+void NetContext::prefetch()
+{
+    if (_prefetch_progress <= 0 || _prefetchF.valid() || !_task || _task->aborted || _task->progress < _prefetch_progress || Task::abort_flag())
+        return;
+    if (_spool != nullptr && !_spool->empty())
+        return;
+
+    _prefetchF = _client->ProcessWithPromiseT<bool>([this](Context& ctx) {
+        std::unique_ptr<PRSTTask> task(new PRSTTask());
+        try
+        {
+            acquire(ctx, *task);
+        }
+        catch (const std::exception& ex) {
+            std::clog << "Task prefetch failed: " << ex.what() << std::endl;
+            return false;
+        }
+
+        std::vector<char> data;
+        boost::optional<std::string> md5;
+        std::string md5hash;
+        if (task->n <= 0)
+            try
+            {
+                download(ctx, task->id, "number", data, md5, md5hash, 3);
+            }
+            catch (const HttpForbiddenException&) {
+                return false;
+            }
+            catch (const std::exception&) {
+                data.clear();
+            }
+        if (!data.empty() && md5 && md5.get() != md5hash)
+            data.clear();
+
+        _next_number = std::move(data);
+        _next_task = std::move(task);
+        return true;
+    });
+}
+
+bool NetContext::prefetched(std::vector<char>& number)
+{
+    if (!_prefetchF.valid())
+        return false;
+    bool done = _prefetchF.get();
+    if (!done || !_next_task)
+        return false;
+    _task = std::move(_next_task);
+    number = std::move(_next_number);
+    return true;
+}
+
+
+// Starts parallel downloads of the files in the order they will be read, as long as the memory limit allows.
+void NetContext::fetch(const std::vector<NetFile*>& files, size_t max_memory, size_t file_size)
+{
+    std::lock_guard<std::mutex> lock(_fetch_mutex);
+    _fetch_limit = max_memory;
+    _fetch_size = file_size;
+    for (auto file : files)
+    {
+        std::error_code ec;
+        if (!_cache_dir.empty() && file->cached() && std::filesystem::exists(cache_path(task_id(), file->filename()), ec))
+            continue;
+        _fetches.emplace_back();
+        _fetches.back().file = file;
+        _fetches.back().filename = file->filename();
+    }
+    fetch_start();
 }
 
+void NetContext::fetch_start()
+{
+    for (auto it = _fetches.begin(); it != _fetches.end(); it++)
+    {
+        if (it->status != Fetch::QUEUED)
+            continue;
+        if (_fetch_memory > 0 && _fetch_memory + _fetch_size > _fetch_limit)
+            break;
+        it->status = Fetch::RUNNING;
+        it->reserved = _fetch_size;
+        _fetch_memory += it->reserved;
+
+        Fetch* fetch = &*it;
+        std::string task_id = this->task_id();
+        _client->ProcessWithPromise([this, fetch, task_id](Context& ctx) {
+            bool done = false;
+            try
+            {
+                done = download(ctx, task_id, fetch->filename, fetch->data, fetch->md5, fetch->md5hash, 3);
+            }
+            catch (const std::exception&) {
+            }
+
+            std::lock_guard<std::mutex> lock(_fetch_mutex);
+            if (!done || fetch->data.empty())
+            {
+                fetch->status = Fetch::FAILED;
+                std::vector<char>().swap(fetch->data);
+            }
+            else
+                fetch->status = Fetch::DONE;
+            _fetch_memory += fetch->data.size();
+            _fetch_memory -= fetch->reserved;
+            fetch->reserved = fetch->data.size();
+            _fetch_done.notify_all();
+            fetch_start();
+        });
+    }
+}
+
+// Takes the downloaded data of the file, false if it was not fetched and has to be read directly.
+bool NetContext::fetched(NetFile& file, boost::optional<std::string>& md5, std::string& md5hash)
+{
+    std::unique_lock<std::mutex> lock(_fetch_mutex);
+    auto it = std::find_if(_fetches.begin(), _fetches.end(), [&](Fetch& fetch) { return fetch.file == &file; });
+    if (it == _fetches.end())
+        return false;
+    if (it->status == Fetch::QUEUED)
+    {
+        _fetches.erase(it);
+        return false;
+    }
+    _fetch_done.wait(lock, [&] { return it->status != Fetch::RUNNING; });
+    bool done = it->status == Fetch::DONE;
+    if (done)
+    {
+        file.buffer() = std::move(it->data);
+        md5 = it->md5;
+        md5hash = it->md5hash;
+    }
+    _fetch_memory -= it->reserved;
+    _fetches.erase(it);
+    fetch_start();
+    return done;
+}
+
+void NetContext::fetch_clear()
+{
+    std::unique_lock<std::mutex> lock(_fetch_mutex);
+    _fetches.remove_if([](Fetch& fetch) { return fetch.status == Fetch::QUEUED; });
+    _fetch_done.wait(lock, [&] { return std::find_if(_fetches.begin(), _fetches.end(), [](Fetch& fetch) { return fetch.status == Fetch::RUNNING; }) == _fetches.end(); });
+    _fetches.clear();
+    _fetch_memory = 0;
+}
+
+// The coroutines hold this, the slot waits for them before it goes away.
+NetContext::~NetContext()
+{
+    if (_heartbeatF.valid())
+        _heartbeatF.wait();
+    if (_prefetchF.valid())
+        _prefetchF.wait();
+    fetch_clear();
+    if (_next_task)
+        std::clog << "Prefetched task " << _next_task->id << " was not started." << std::endl;
+}
+
+void NetSpool::add(const std::string& worker_id, const std::string& task_id, const std::string& res, const std::string& cert, const std::string& time)
+{
+    std::string name = task_id;
+    std::replace(name.begin(), name.end(), '/', '_');
+    std::replace(name.begin(), name.end(), '\\', '_');
+    std::string filename = _dir + "/" + name + ".res";
+    FILE* fd = fopen((filename + ".tmp").data(), "wb");
+    bool written = fd != nullptr && fprintf(fd, "%s\n%s\n%s\n%s\n%s\n", task_id.data(), worker_id.data(), res.data(), cert.data(), time.data()) > 0;
+    if (fd != nullptr)
+    {
+        fflush(fd);
+        fclose(fd);
+    }
+    if (written)
+    {
+        remove(filename.data());
+        rename((filename + ".tmp").data(), filename.data());
+    }
+    else
+    {
+        remove((filename + ".tmp").data());
+        std::clog << "Can't write " << filename << ", the result is kept in memory." << std::endl;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _unspooled.push_back({ task_id, worker_id, res, cert, time });
+    }
+    flush();
+}
+
+std::vector<std::string> NetSpool::pending()
+{
+    std::vector<std::string> files;
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(_dir, ec))
+        if (entry.path().extension() == ".res")
+            files.push_back(entry.path().string());
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+bool NetSpool::read(const std::string& filename, std::vector<std::string>& fields)
+{
+    FILE* fd = fopen(filename.data(), "rb");
+    if (fd == nullptr)
+        return false;
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), fd) != nullptr)
+    {
+        fields.emplace_back(buf);
+        while (!fields.back().empty() && (fields.back().back() == '\n' || fields.back().back() == '\r'))
+            fields.back().pop_back();
+    }
+    fclose(fd);
+    if (fields.size() < 5)
+    {
+        std::clog << filename << " is corrupted." << std::endl;
+        rename(filename.data(), (filename + ".bad").data());
+        return false;
+    }
+    return true;
+}
+
+// Returns false if the result has to be posted again later. Results rejected by the server are set aside.
+bool NetSpool::post(Context& ctx, std::vector<std::string>& fields, const std::string& filename)
+{
+    try
+    {
+        RequestBuilder(ctx)
+            .Post(_url + "llr/res/" + fields[0])
+            .Argument("workerID", fields[1])
+            .Argument("res", fields[2])
+            .Argument("cert", fields[3])
+            .Argument("time", fields[4])
+            .Argument("version", NET_PRST_VERSION "." VERSION_BUILD)
+            .Execute();
+    }
+    catch (const HttpAuthenticationException&) {
+        std::clog << "Result of " << fields[0] << " rejected, task timed out." << std::endl;
+        if (!filename.empty())
+            rename(filename.data(), (filename + ".rejected").data());
+        return true;
+    }
+    catch (const HttpForbiddenException&) {
+        std::clog << "Result of " << fields[0] << " rejected, task not found." << std::endl;
+        if (!filename.empty())
+            rename(filename.data(), (filename + ".rejected").data());
+        return true;
+    }
+    catch (const std::exception& ex) {
+        std::clog << "Can't upload result: " << ex.what() << std::endl;
+        return false;
+    }
+    if (!filename.empty())
+        remove(filename.data());
+    return true;
+}
+
+// Posts the spooled results in the background until the spool is empty or the process terminates.
+void NetSpool::flush()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_flushF.valid() && _flushF.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return;
+    _flushF = _client->ProcessWithPromise([this](Context& ctx) {
+        int failures = 0;
+        while (!Task::abort_flag())
+        {
+            std::vector<std::string> fields;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_unspooled.empty())
+                    fields = _unspooled.front();
+            }
+            if (!fields.empty())
+            {
+                if (post(ctx, fields, ""))
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _unspooled.pop_front();
+                    failures = 0;
+                    continue;
+                }
+            }
+            else
+            {
+                std::vector<std::string> files = pending();
+                if (files.empty())
+                    return;
+                bool failed = false;
+                for (auto& filename : files)
+                {
+                    fields.clear();
+                    if (read(filename, fields) && !post(ctx, fields, filename))
+                    {
+                        failed = true;
+                        break;
+                    }
+                }
+                if (!failed)
+                {
+                    failures = 0;
+                    continue;
+                }
+            }
+            for (int i = NetContext::backoff(++failures).total_seconds(); i > 0 && !Task::abort_flag(); i--)
+                ctx.Sleep(boost::posix_time::seconds(1));
+        }
+    }).share();
+}
+
+void NetSpool::drain()
+{
+    flush();
+    wait();
+}
+
+bool NetSpool::empty()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_unspooled.empty())
+            return false;
+    }
+    return pending().empty();
+}
+
+void NetSpool::wait()
+{
+    std::shared_future<void> localF;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        localF = _flushF;
+    }
+    if (localF.valid())
+        localF.wait();
+}
+
+// Task slots share the abort flag of the process. A task aborted by the server stops the tests of all slots,
+// the flag is reset once every slot has left its test, and the slots with valid tasks resume them.
+class NetSlots
+{
+public:
+    void enter()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running++;
+    }
+
+    void leave()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running--;
+        _idle.notify_all();
+    }
+
+    // Returns false if the process is being terminated.
+    bool recover()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (NetContext::task_aborts == 0)
+            return !Task::abort_flag();
+        _idle.wait(lock, [&] { return _running == 0; });
+        if (NetContext::task_aborts > 0)
+        {
+            NetContext::task_aborts = 0;
+            Task::abort_reset();
+        }
+        return true;
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _idle;
+    int _running = 0;
+};
 
 int net_main(int argc, char *argv[])
 {
     int i;
-    GWState gwstate;
+    std::vector<int> thread_counts(1, 1);
+    int slot_count = 1;
     std::string url;
     std::string worker_id;
     int log_level = Logging::LEVEL_INFO;
     int net_log_level = Logging::LEVEL_WARNING;
     uint64_t maxMem = 2048*1048576ULL;
     int disk_write_time = Task::DISK_WRITE_TIME;
+    int prefetch_percent = 95;
+    int upload_slots = 2;
+    int upload_time = 0;
+    int heartbeat_time = 0;
+    double upload_rate = 0;
+    std::string cache_dir;
+    std::string spool_dir = "spool";
+    char* arg;
 
     for (i = 1; i < argc; i++)
         if (argv[i][0] == '-' && argv[i][1])
@@ -399,16 +1132,25 @@ int net_main(int argc, char *argv[])
             {
             case 't':
                 if (argv[i][2] && isdigit(argv[i][2]))
-                    gwstate.thread_count = atoi(argv[i] + 2);
+                    arg = argv[i] + 2;
                 else if (!argv[i][2] && i < argc - 1)
                 {
                     i++;
-                    gwstate.thread_count = atoi(argv[i]);
+                    arg = argv[i];
                 }
                 else
                     break;
-                if (gwstate.thread_count == 0 || gwstate.thread_count > 64)
-                    gwstate.thread_count = 1;
+                // Thread counts of the slots separated by commas, the last one applies to the remaining slots.
+                thread_counts.clear();
+                while (arg != nullptr)
+                {
+                    thread_counts.push_back(atoi(arg));
+                    if (thread_counts.back() == 0 || thread_counts.back() > 64)
+                        thread_counts.back() = 1;
+                    arg = strchr(arg, ',');
+                    if (arg != nullptr)
+                        arg++;
+                }
                 continue;
 
             case 'M':
@@ -436,7 +1178,39 @@ int net_main(int argc, char *argv[])
                 continue;
             }
 
-            if (strcmp(argv[i], "-time") == 0)
+            if (i < argc - 1 && strcmp(argv[i], "-slots") == 0)
+            {
+                i++;
+                slot_count = atoi(argv[i]);
+                if (slot_count < 1 || slot_count > 64)
+                    slot_count = 1;
+            }
+            else if (i < argc - 1 && strcmp(argv[i], "-prefetch") == 0)
+            {
+                i++;
+                prefetch_percent = atoi(argv[i]);
+            }
+            else if (i < argc - 1 && strcmp(argv[i], "-uploads") == 0)
+            {
+                i++;
+                upload_slots = atoi(argv[i]);
+            }
+            else if (i < argc - 1 && strcmp(argv[i], "-cache") == 0)
+            {
+                i++;
+                cache_dir = argv[i];
+            }
+            else if (i < argc - 1 && strcmp(argv[i], "-spool") == 0)
+            {
+                i++;
+                spool_dir = argv[i];
+            }
+            else if (i < argc - 1 && strcmp(argv[i], "-bandwidth") == 0)
+            {
+                i++;
+                upload_rate = atof(argv[i])*1024;
+            }
+            else if (strcmp(argv[i], "-time") == 0)
             {
                 while (true)
                     if (i < argc - 2 && strcmp(argv[i + 1], "write") == 0)
@@ -444,6 +1218,16 @@ int net_main(int argc, char *argv[])
                         i += 2;
                         disk_write_time = atoi(argv[i]);
                     }
+                    else if (i < argc - 2 && strcmp(argv[i + 1], "upload") == 0)
+                    {
+                        i += 2;
+                        upload_time = atoi(argv[i]);
+                    }
+                    else if (i < argc - 2 && strcmp(argv[i + 1], "heartbeat") == 0)
+                    {
+                        i += 2;
+                        heartbeat_time = atoi(argv[i]);
+                    }
                     else if (i < argc - 2 && strcmp(argv[i + 1], "progress") == 0)
                     {
                         i += 2;
@@ -476,12 +1260,16 @@ int net_main(int argc, char *argv[])
         }
     if (url.empty() || url.find("http://") != 0 || worker_id.empty())
     {
-        printf("Usage: PRST -net -i <WorkerID> http://<host>:<port>/api/\n");
+        printf("Usage: PRST -net -i <WorkerID> [-t <threads>[,<threads>...]] [-slots <count>] [-time [write <sec>] [upload <sec>] [heartbeat <sec>]] [-prefetch <percent>] [-uploads <count>] [-bandwidth <KB/s>] [-cache <dir>] [-spool <dir>] http://<host>:<port>/api/\n");
         return 0;
     }
 
-    NetContext net(url, worker_id, log_level, net_log_level);
-    Logging& logging = net.logging();
+    std::error_code ec;
+    if (!cache_dir.empty())
+        std::filesystem::create_directories(cache_dir, ec);
+    else if (upload_time > 0)
+        std::clog << "Upload interval needs -cache, checkpoints are uploaded as they are written." << std::endl;
+    std::filesystem::create_directories(spool_dir, ec);
 
 	// Set the log-level to a reasonable value
 	boost::log::core::get()->set_filter
@@ -493,199 +1281,258 @@ int net_main(int argc, char *argv[])
 #endif // DEBUG
 	);
 
-	while (true)
-	{
-        if (Task::abort_flag())
-            return 1;
-        logging.set_prefix("");
-        net.task().reset(new PRSTTask());
-
-		// Run our example in a lambda co-routine
-		auto done = net.client()->ProcessWithPromiseT<bool>([&](Context& ctx) {
-			// This is the co-routine, running in a worker-thread
-
-			try
-			{
-
-				// Construct a request to the server
-				SerializeFromJson(*net.task(), RequestBuilder(ctx)
-					.Post(net.url() + "llr/new")
-					.Argument("workerID", net.worker_id())
-					.Argument("uptime", net.uptime())
-					.Argument("version", NET_PRST_VERSION "." VERSION_BUILD)
-
-					// Send the request
-					.Execute()
-				);
-			}
-			catch (const std::exception& ex) {
-                std::clog << "Task acquisition failed: " << ex.what() << std::endl;
-				return false;
-			}
-
-			return true;
-		});
-		if (!done.get())
-		{
-			std::this_thread::sleep_for(std::chrono::minutes(1));
-			continue;
-		}
-        logging.info("%s\n", net.task_id().data());
-
-        NetFile file_number(net, "number", 0);
-        InputNum input;
-        if (net.task()->n > 0)
-            input.init(net.task()->sk, net.task()->sb, net.task()->n, net.task()->c);
-        else if (!input.read(file_number))
-        {
-            logging.error("Number file is missing or corrupted.\n");
-            std::this_thread::sleep_for(std::chrono::minutes(1));
-            continue;
-        }
-        if (net.task()->options.find("FFT_Increment") != net.task()->options.end())
-            gwstate.next_fft_count = std::stoi(net.task()->options["FFT_Increment"]);
-        net.task()->a = net.task()->L = net.task()->L2 = net.task()->M = 0;
-        int maxSize = (int)(maxMem/(gwnum_size(gwstate.gwdata())));
-
-        logging.progress() = Progress();
-        logging.progress().time_init(net.task()->time);
-        if (net.task()->options.find("write_time") != net.task()->options.end())
-            Task::DISK_WRITE_TIME = std::stoi(net.task()->options["write_time"]);
-        else
-            Task::DISK_WRITE_TIME = disk_write_time;
-        
-        Params params;
-        bool supportLLR2 = true;
-        if (net.task()->options.find("support") != net.task()->options.end())
-            supportLLR2 = net.task()->options["support"] == "LLR2";
-        int proof_op = Proof::NO_OP;
-        if (net.task()->mode == "SavePoints")
-            proof_op = Proof::SAVE;
-        if (net.task()->mode == "BuildCert")
-            proof_op = Proof::BUILD;
-        if (net.task()->mode == "VerifyCert")
-            proof_op = Proof::CERT;
-        int proof_count = 16;
-        if (net.task()->options.find("Gerbicz") != net.task()->options.end())
-            params.CheckStrong = net.task()->options["Gerbicz"] == "1";
-        if (net.task()->options.find("ProofCount") != net.task()->options.end())
-            proof_count = std::stoi(net.task()->options["ProofCount"]);
-        if (net.task()->options.find("PointsPerL2") != net.task()->options.end())
-            params.StrongCount = proof_count/std::stoi(net.task()->options["PointsPerL2"]);
-        if (net.task()->options.find("ProofName") != net.task()->options.end())
-            params.ProofPointFilename = net.task()->options["ProofName"];
-        if (net.task()->options.find("ProductName") != net.task()->options.end())
-            params.ProofProductFilename = net.task()->options["ProductName"];
-
-        std::list<std::unique_ptr<NetFile>> files;
-        auto newFile = [&](const std::string& filename, uint32_t fingerprint, char type = BaseExp::State::TYPE)
-        {
-            if (supportLLR2)
-                return files.emplace_back(new LLR2NetFile(net, filename, gwstate.fingerprint, type)).get();
-            else
-                return files.emplace_back(new NetFile(net, filename, fingerprint)).get();
-        };
-        uint32_t fingerprint = input.fingerprint();
-        gwstate.fingerprint = fingerprint;
-        File* file_cert = newFile(!params.ProofPointFilename.empty() ? params.ProofPointFilename + ".crt" : "proof.crt", fingerprint, Proof::Certificate::TYPE);
-        std::unique_ptr<Proof> proof;
-        if (proof_op != Proof::NO_OP)
-            proof.reset(new Proof(proof_op, proof_count, input, params, *file_cert, logging));
-        if (proof && net.task()->options.find("CachePoints") != net.task()->options.end())
-            proof->set_cache_points(true);
-
-        std::unique_ptr<Fermat> fermat;
-
-        if (proof_op == Proof::CERT)
-        {
-        }
-        else if (net.task()->type == "Pocklington")
+    auto client = RestClient::Create();
+    NetUploader uploader(upload_slots);
+    uploader.set_rate(upload_rate);
+    NetSlots slots;
+    NetSpool spool(spool_dir, client.get(), url);
+    spool.flush();
+
+    // Each slot is a separate worker for the server, with its own gwnum state and logging.
+    auto run_slot = [&](int slot) -> int
+    {
+        std::string slot_worker_id = slot_count > 1 ? worker_id + "-" + std::to_string(slot + 1) : worker_id;
+        NetContext net(url, slot_worker_id, log_level, net_log_level, client.get(), uploader);
+        net.set_prefetch_progress(prefetch_percent/100.0);
+        net.set_spool(&spool);
+        if (!cache_dir.empty())
+            net.set_cache_dir(cache_dir);
+        Logging& logging = net.logging();
+        GWState gwstate;
+        GWScratchPool scratch(gwstate);
+        gwstate.thread_count = thread_counts[std::min(slot, (int)thread_counts.size() - 1)];
+
+        bool resume = false;
+        while (true)
         {
-            fermat.reset(new Pocklington(input, params, logging, proof.get()));
-        }
-        else
-            fermat.reset(new Fermat(Fermat::AUTO, input, params, logging, proof.get()));
+            if (Task::abort_flag() && !slots.recover())
+                return 1;
+            logging.set_prefix("");
+            std::vector<char> number;
+            if (resume)
+                resume = false;
+            else if (!net.prefetched(number))
+            {
+                spool.drain();
+                net.task().reset(new PRSTTask());
 
-        gwstate.maxmulbyconst = params.maxmulbyconst;
-        input.setup(gwstate);
-        logging.info("Using %s.\n", gwstate.fft_description.data());
-        net.task()->fft_desc = gwstate.fft_description;
-        net.task()->fft_len = gwstate.fft_length;
+                auto done = net.client()->ProcessWithPromiseT<bool>([&](Context& ctx) {
+                    try
+                    {
+                        net.acquire(ctx, *net.task());
+                    }
+                    catch (const std::exception& ex) {
+                        std::clog << "Task acquisition failed: " << ex.what() << std::endl;
+                        return false;
+                    }
+
+                    return true;
+                });
+                if (!done.get())
+                {
+                    std::this_thread::sleep_for(std::chrono::minutes(1));
+                    continue;
+                }
+            }
+            logging.info("%s\n", net.task_id().data());
+
+            if (net.task()->options.find("ChunkSize") != net.task()->options.end())
+                net.set_chunk_size(std::stoull(net.task()->options["ChunkSize"]));
+            else
+                net.set_chunk_size(0);
+            NetFile file_number(net, "number", 0);
+            file_number.buffer() = std::move(number);
+            InputNum input;
+            if (net.task()->n > 0)
+                input.init(net.task()->sk, net.task()->sb, net.task()->n, net.task()->c);
+            else if (!input.read(file_number))
+            {
+                logging.error("Number file is missing or corrupted.\n");
+                std::this_thread::sleep_for(std::chrono::minutes(1));
+                continue;
+            }
+            if (net.task()->options.find("FFT_Increment") != net.task()->options.end())
+                gwstate.next_fft_count = std::stoi(net.task()->options["FFT_Increment"]);
+            net.task()->a = net.task()->L = net.task()->L2 = net.task()->M = 0;
+            int maxSize = (int)(maxMem/(gwnum_size(gwstate.gwdata())));
+
+            logging.progress() = Progress();
+            logging.progress().time_init(net.task()->time);
+            // The write time is global, the slots use the command line value.
+            if (slot_count == 1 && net.task()->options.find("write_time") != net.task()->options.end())
+                Task::DISK_WRITE_TIME = std::stoi(net.task()->options["write_time"]);
+            else
+                Task::DISK_WRITE_TIME = disk_write_time;
+            if (net.task()->options.find("upload_time") != net.task()->options.end())
+                net.set_upload_interval(std::stoi(net.task()->options["upload_time"]));
+            else
+                net.set_upload_interval(upload_time);
+            if (net.task()->options.find("upload_rate") != net.task()->options.end())
+                uploader.set_rate(std::stod(net.task()->options["upload_rate"])*1024);
+            if (net.task()->options.find("heartbeat_time") != net.task()->options.end())
+                net.set_heartbeat_interval(std::stoi(net.task()->options["heartbeat_time"]));
+            else
+                net.set_heartbeat_interval(heartbeat_time);
+
+            Params params;
+            bool supportLLR2 = true;
+            if (net.task()->options.find("support") != net.task()->options.end())
+                supportLLR2 = net.task()->options["support"] == "LLR2";
+            int proof_op = Proof::NO_OP;
+            if (net.task()->mode == "SavePoints")
+                proof_op = Proof::SAVE;
+            if (net.task()->mode == "BuildCert")
+                proof_op = Proof::BUILD;
+            if (net.task()->mode == "VerifyCert")
+                proof_op = Proof::CERT;
+            int proof_count = 16;
+            if (net.task()->options.find("Gerbicz") != net.task()->options.end())
+                params.CheckStrong = net.task()->options["Gerbicz"] == "1";
+            if (net.task()->options.find("ProofCount") != net.task()->options.end())
+                proof_count = std::stoi(net.task()->options["ProofCount"]);
+            if (net.task()->options.find("PointsPerL2") != net.task()->options.end())
+                params.StrongCount = proof_count/std::stoi(net.task()->options["PointsPerL2"]);
+            if (net.task()->options.find("ProofName") != net.task()->options.end())
+                params.ProofPointFilename = net.task()->options["ProofName"];
+            if (net.task()->options.find("ProductName") != net.task()->options.end())
+                params.ProofProductFilename = net.task()->options["ProductName"];
+
+            std::list<std::unique_ptr<NetFile>> files;
+            auto newFile = [&](const std::string& filename, uint32_t fingerprint, char type = BaseExp::State::TYPE, int priority = NetFile::PRIORITY_RESULT)
+            {
+                NetFile* file;
+                if (supportLLR2)
+                    file = files.emplace_back(new LLR2NetFile(net, filename, gwstate.fingerprint, type)).get();
+                else
+                    file = files.emplace_back(new NetFile(net, filename, fingerprint)).get();
+                file->set_upload_priority(priority);
+                return file;
+            };
+            auto newCheckpoint = [&](const std::string& filename, uint32_t fingerprint)
+            {
+                NetFile* file = files.emplace_back(new NetFile(net, filename, fingerprint)).get();
+                file->set_upload_priority(NetFile::PRIORITY_CHECKPOINT);
+                return file;
+            };
+            uint32_t fingerprint = input.fingerprint();
+            gwstate.fingerprint = fingerprint;
+            File* file_cert = newFile(!params.ProofPointFilename.empty() ? params.ProofPointFilename + ".crt" : "proof.crt", fingerprint, Proof::Certificate::TYPE);
+            std::unique_ptr<Proof> proof;
+            if (proof_op != Proof::NO_OP)
+                proof.reset(new Proof(proof_op, proof_count, input, params, *file_cert, logging));
+            if (proof && net.task()->options.find("CachePoints") != net.task()->options.end())
+                proof->set_cache_points(true);
+
+            std::unique_ptr<Fermat> fermat;
 
-        try
-        {
             if (proof_op == Proof::CERT)
             {
-                fingerprint = File::unique_fingerprint(fingerprint, file_cert->filename());
-                File* file_checkpoint = files.emplace_back(new NetFile(net, "checkpoint", fingerprint)).get();
-                File* file_recoverypoint = newFile("recoverypoint", fingerprint);
-                proof->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging);
             }
-            else if (proof)
+            else if (net.task()->type == "Pocklington")
+            {
+                fermat.reset(new Pocklington(input, params, logging, proof.get()));
+            }
+            else
+                fermat.reset(new Fermat(Fermat::AUTO, input, params, logging, proof.get()));
+
+            gwstate.maxmulbyconst = params.maxmulbyconst;
+            input.setup(gwstate);
+            logging.info("Using %s.\n", gwstate.fft_description.data());
+            net.task()->fft_desc = gwstate.fft_description;
+            net.task()->fft_len = gwstate.fft_length;
+
+            // Decided before leave(), another slot may reset the abort flag after it.
+            bool interrupted = false;
+            slots.enter();
+            try
+            {
+                if (proof_op == Proof::CERT)
+                {
+                    fingerprint = File::unique_fingerprint(fingerprint, file_cert->filename());
+                    File* file_checkpoint = newCheckpoint("checkpoint", fingerprint);
+                    File* file_recoverypoint = newFile("recoverypoint", fingerprint, BaseExp::State::TYPE, NetFile::PRIORITY_CHECKPOINT);
+                    proof->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging);
+                }
+                else if (proof)
+                {
+                    fingerprint = File::unique_fingerprint(fingerprint, std::to_string(fermat->a()) + "." + std::to_string(proof->points()[proof_count]));
+                    File* file_proofpoint = newFile(!params.ProofPointFilename.empty() ? params.ProofPointFilename : "proof", fingerprint);
+                    File* file_proofproduct = newFile(!params.ProofProductFilename.empty() ? params.ProofProductFilename : "prod", fingerprint, Proof::Product::TYPE);
+                    proof->init_files(file_proofpoint, file_proofproduct, file_cert);
+                    if (proof_op == Proof::BUILD)
+                    {
+                        // The products and the end points are downloaded in parallel before the build reads them.
+                        std::vector<NetFile*> fetch;
+                        if (!proof->Li())
+                            fetch.push_back(static_cast<NetFile*>(proof->file_points()[0]));
+                        fetch.push_back(static_cast<NetFile*>(proof->file_points()[proof_count]));
+                        for (auto file : proof->file_products())
+                            fetch.push_back(static_cast<NetFile*>(file));
+                        net.fetch(fetch, maxMem, input.bitlen()/8 + 64);
+                    }
+
+                    File* file_checkpoint = newCheckpoint("checkpoint", fingerprint);
+                    File* file_recoverypoint = newFile("recoverypoint", fingerprint, BaseExp::State::TYPE, NetFile::PRIORITY_CHECKPOINT);
+                    fermat->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging, proof.get());
+                }
+                else if (fermat)
+                {
+                    File* file_checkpoint = newCheckpoint("checkpoint", fingerprint);
+                    File* file_recoverypoint = newFile("recoverypoint", fingerprint, BaseExp::State::TYPE, NetFile::PRIORITY_CHECKPOINT);
+                    fermat->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging, nullptr);
+                }
+            }
+            catch (const TaskAbortException&)
             {
-                fingerprint = File::unique_fingerprint(fingerprint, std::to_string(fermat->a()) + "." + std::to_string(proof->points()[proof_count]));
-                File* file_proofpoint = newFile(!params.ProofPointFilename.empty() ? params.ProofPointFilename : "proof", fingerprint);
-                File* file_proofproduct = newFile(!params.ProofProductFilename.empty() ? params.ProofProductFilename : "prod", fingerprint, Proof::Product::TYPE);
-                proof->init_files(file_proofpoint, file_proofproduct, file_cert);
+                interrupted = Task::abort_flag();
+            }
+            slots.leave();
+            net.fetch_clear();
+            report_peak_memory(logging);
+
+            GWScratchPool::done(gwstate);
 
-                File* file_checkpoint = files.emplace_back(new NetFile(net, "checkpoint", fingerprint)).get();
-                File* file_recoverypoint = newFile("recoverypoint", fingerprint);
-                fermat->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging, proof.get());
+            net.upload_wait();
+            if (interrupted && !slots.recover())
+                return 1;
+            if (net.task()->aborted)
+            {
+                net.cache_clear(net.task_id());
+                continue;
             }
-            else if (fermat)
+            // Stopped by the task of another slot, the test continues from its checkpoint.
+            if (interrupted)
             {
-                File* file_checkpoint = files.emplace_back(new NetFile(net, "checkpoint", fingerprint)).get();
-                File* file_recoverypoint = newFile("recoverypoint", fingerprint);
-                fermat->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging, nullptr);
+                resume = true;
+                continue;
             }
-        }
-        catch (const TaskAbortException&)
-        {
+
+            // The result is spooled to disk first and posted while the next task is set up.
+            std::string task_id = net.task_id();
+            std::string res = proof_op == Proof::CERT ? proof->res64() : fermat->success() ? "prime" : fermat->res64();
+            std::string cert = proof && proof_op != Proof::CERT ? proof->res64() : "";
+            std::string time = std::to_string(logging.progress().time_total());
+            spool.add(net.worker_id(), task_id, res, cert, time);
+            net.cache_clear(task_id);
         }
 
-        gwstate.done();
+        return 0;
+    };
 
-        net.upload_wait();
-        if (net.task()->aborted)
-        {
-            Task::abort_reset();
-            continue;
-        }
-        if (Task::abort_flag())
-            return 1;
+    int ret = 0;
+    if (slot_count == 1)
+        ret = run_slot(0);
+    else
+    {
+        std::vector<std::thread> threads;
+        std::vector<int> results(slot_count, 0);
+        for (i = 0; i < slot_count; i++)
+            threads.emplace_back([&, i]() { results[i] = run_slot(i); });
+        for (auto& thread : threads)
+            thread.join();
+        ret = *std::max_element(results.begin(), results.end());
+    }
+    uploader.done();
 
-		// Run our example in a lambda co-routine
-		auto doneRet = net.client()->ProcessWithPromise([&](Context& ctx) {
-			// This is the co-routine, running in a worker-thread
-
-			int i;
-			for (i = 0; i < 10; i++)
-				try
-				{
-					// Construct a request to the server
-					RequestBuilder(ctx)
-						.Post(net.url() + "llr/res/" + net.task_id())
-						.Argument("workerID", net.worker_id())
-                        .Argument("res", proof_op == Proof::CERT ? proof->res64() : fermat->success() ? "prime" : fermat->res64())
-                        .Argument("cert", proof && proof_op != Proof::CERT ? proof->res64() : "")
-                        .Argument("time", std::to_string(logging.progress().time_total()))
-                        .Argument("version", NET_PRST_VERSION "." VERSION_BUILD)
-
-						// Send the request
-						.Execute();
-					break;
-				}
-				catch (const std::exception& ex) {
-					std::clog << "Can't upload result: " << ex.what() << std::endl;
-					ctx.Sleep(boost::posix_time::microseconds(i*5000000));
-				}
-		});
-
-		doneRet.get();
-	}
-
-    net.done();
-
-    return 0;
+    return ret;
 }
-
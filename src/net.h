@@ -3,6 +3,9 @@
 #include <chrono>
 #include <thread>
 #include <deque>
+#include <list>
+#include <atomic>
+#include <condition_variable>
 
 #include "arithmetic.h"
 #include "file.h"
@@ -53,9 +56,15 @@ BOOST_FUSION_ADAPT_STRUCT(
 )
 
 class NetContext;
+class NetSpool;
 
 class NetFile : public File
 {
+public:
+    static const int PRIORITY_CHECKPOINT = 0;
+    static const int PRIORITY_NORMAL = 1;
+    static const int PRIORITY_RESULT = 2;
+
 public:
     NetFile(NetContext& net_ctx, const std::string& filename, uint32_t fingerprint) : File(filename, fingerprint), _net_ctx(net_ctx) { }
 
@@ -69,16 +78,27 @@ public:
     void free_buffer() override;
     void clear(bool recursive = false) override;
 
-    virtual void on_upload();
-    virtual void on_uploaded();
+    virtual void on_upload(std::vector<char>& buffer);
+    virtual void on_uploaded(std::vector<char>& buffer);
 
     NetContext& net() { return _net_ctx; }
     std::string& md5hash() { return _md5hash; }
+    int upload_priority() { return _upload_priority; }
+    void set_upload_priority(int priority) { _upload_priority = priority; }
+    std::chrono::system_clock::time_point& upload_time() { return _upload_time; }
+    bool cached() { return _cached; }
 
 protected:
     NetContext& _net_ctx;
     std::string _md5hash;
+    // Computed by a subclass together with its own checksum, used instead of hashing the buffer again.
+    std::string _commit_md5hash;
+    int _upload_priority = PRIORITY_NORMAL;
+    std::chrono::system_clock::time_point _upload_time;
+    bool _cached = true;
+    // While uploading, the data belongs to the upload slot buffer once the file swaps it out.
     bool _uploading = false;
+    std::vector<char>* _upload_buffer = nullptr;
     bool _free_buffer = false;
 };
 
@@ -101,10 +121,10 @@ public:
     class LoggingNetFile : public NetFile
     {
     public:
-        LoggingNetFile(NetContext& net) : NetFile(net, "stderr", 0) { }
+        LoggingNetFile(NetContext& net) : NetFile(net, "stderr", 0) { _cached = false; }
 
         Writer* get_writer() override;
-        void on_upload() override;
+        void on_upload(std::vector<char>& buffer) override;
     };
 
 public:
@@ -122,38 +142,126 @@ private:
     LoggingNetFile _file;
 };
 
-class NetContext
+// Upload scheduler shared by the task slots of a worker, they share its connections and its bandwidth limit.
+class NetUploader
 {
 public:
-    NetContext(std::string& url, std::string& worker_id, int log_level, int net_log_level) : _url(url), _worker_id(worker_id), _logging(log_level, net_log_level, *this), _start_time(std::chrono::system_clock::now())
+    NetUploader(int slots)
     {
-        _client = restc_cpp::RestClient::Create();
-
         restc_cpp::Request::Properties properties;
         properties.headers["Content-Type"] = "application/octet-stream";
         _putter = restc_cpp::RestClient::Create(properties);
+        _slots = std::vector<Slot>(slots > 0 ? slots : 1);
     }
 
+    // The caller holds the mutex.
     void upload(NetFile* file);
+    bool queued(NetFile* file);
+    void cancel(NetFile* file);
+
+    void wait(NetContext& net);
+    void done();
+    void set_rate(double bytes_per_second) { _rate = bytes_per_second; }
+
+    std::mutex& mutex() { return _mutex; }
+
+private:
+    struct Slot
+    {
+        bool busy = false;
+        bool cancelled = false;
+        NetFile* file = nullptr;
+        std::vector<char> buffer;
+        std::future<void> future;
+    };
+
+    void run(Slot& slot);
+    NetFile* next();
+    bool busy(NetContext& net);
+    boost::posix_time::time_duration pace(size_t size);
+
+private:
+    std::unique_ptr<restc_cpp::RestClient> _putter;
+    std::vector<Slot> _slots;
+    std::deque<NetFile*> _queue;
+    std::mutex _mutex;
+    std::condition_variable _idle;
+    double _rate = 0;
+    std::chrono::system_clock::time_point _next;
+};
+
+class NetContext
+{
+public:
+    NetContext(std::string& url, std::string& worker_id, int log_level, int net_log_level, restc_cpp::RestClient* client, NetUploader& uploader) : _url(url), _worker_id(worker_id), _logging(log_level, net_log_level, *this), _start_time(std::chrono::system_clock::now()), _client(client), _uploader(uploader)
+    {
+    }
+    ~NetContext();
+
+    void upload(NetFile* file) { _uploader.upload(file); }
     bool upload_queued(NetFile* file);
     void upload_cancel(NetFile* file);
     void upload_wait();
-    void done();
+    bool upload_defer(NetFile* file);
+    void upload_flush(bool all);
+    void heartbeat();
+    void abort_task();
+
+    bool cache_read(NetFile& file);
+    void cache_write(NetFile& file, std::vector<char>& buffer);
+    void cache_remove(NetFile& file);
+    void cache_clear(const std::string& task_id);
+    void set_cache_dir(const std::string& dir) { _cache_dir = dir; }
+
+    void acquire(restc_cpp::Context& ctx, PRSTTask& task);
+    bool download(restc_cpp::Context& ctx, const std::string& task_id, const std::string& filename, std::vector<char>& data, boost::optional<std::string>& md5, std::string& md5hash, int max_failures = -1);
+    void prefetch();
+    bool prefetched(std::vector<char>& number);
+    void fetch(const std::vector<NetFile*>& files, size_t max_memory, size_t file_size);
+    bool fetched(NetFile& file, boost::optional<std::string>& md5, std::string& md5hash);
+    void fetch_clear();
+    void set_prefetch_progress(double value) { _prefetch_progress = value; }
+    void set_spool(NetSpool* spool) { _spool = spool; }
+    void set_chunk_size(size_t value) { _chunk_size = value; }
+    void set_upload_interval(int seconds) { _upload_interval = seconds; }
+    void set_heartbeat_interval(int seconds) { _heartbeat_interval = seconds; }
+    static boost::posix_time::time_duration backoff(int failures);
 
     std::string& url() { return _url; }
     std::string& worker_id() { return _worker_id; }
     std::string& task_id() { return _task->id; }
     std::chrono::seconds::rep uptime() { return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - _start_time).count(); }
+    size_t chunk_size() { return _chunk_size; }
 
     NetLogging& logging() { return _logging; }
-    restc_cpp::RestClient* client() { return _client.get(); }
+    restc_cpp::RestClient* client() { return _client; }
+    NetUploader& uploader() { return _uploader; }
     std::unique_ptr<PRSTTask>& task() { return _task; }
 
-    std::mutex& upload_mutex() { return _upload_mutex; }
-    std::vector<char>& buffer() { return _upload_buffer; }
+    std::mutex& upload_mutex() { return _uploader.mutex(); }
+
+    // Tasks aborted by the server since the slots last reset the shared abort flag.
+    static std::atomic<int> task_aborts;
 
 private:
-    void upload_written();
+    struct Fetch
+    {
+        static const int QUEUED = 0;
+        static const int RUNNING = 1;
+        static const int DONE = 2;
+        static const int FAILED = 3;
+
+        NetFile* file;
+        std::string filename;
+        int status = QUEUED;
+        size_t reserved = 0;
+        std::vector<char> data;
+        boost::optional<std::string> md5;
+        std::string md5hash;
+    };
+
+    std::string cache_path(const std::string& task_id, const std::string& filename);
+    void fetch_start();
 
 private:
     std::string _url;
@@ -161,15 +269,60 @@ private:
     NetLogging _logging;
     std::chrono::system_clock::time_point _start_time;
 
-    std::unique_ptr<restc_cpp::RestClient> _client;
-    std::unique_ptr<restc_cpp::RestClient> _putter;
+    restc_cpp::RestClient* _client;
+    NetUploader& _uploader;
 
     std::unique_ptr<PRSTTask> _task;
 
-    std::future<void> _uploadF;
-    std::deque<NetFile*> _upload_queue;
-    std::mutex _upload_mutex;
-    std::vector<char> _upload_buffer;
+    size_t _chunk_size = 0;
+    std::string _cache_dir;
+    double _prefetch_progress = 0.95;
+    NetSpool* _spool = nullptr;
+    std::future<bool> _prefetchF;
+    std::unique_ptr<PRSTTask> _next_task;
+    std::vector<char> _next_number;
+
+    // Files downloaded ahead of their reads, the memory they hold is limited.
+    std::list<Fetch> _fetches;
+    std::mutex _fetch_mutex;
+    std::condition_variable _fetch_done;
+    size_t _fetch_memory = 0;
+    size_t _fetch_limit = 0;
+    size_t _fetch_size = 0;
+
+    // Checkpoints written within the upload interval are held back, only their latest version is uploaded.
+    int _upload_interval = 0;
+    std::deque<NetFile*> _upload_deferred;
+    int _heartbeat_interval = 0;
+    std::chrono::system_clock::time_point _heartbeat_time;
+    std::future<void> _heartbeatF;
+};
+
+// Results waiting to be posted, one file per task. They are kept on disk until the server accepts them.
+class NetSpool
+{
+public:
+    NetSpool(const std::string& dir, restc_cpp::RestClient* client, const std::string& url) : _dir(dir), _client(client), _url(url) { }
+    ~NetSpool() { wait(); }
+
+    void add(const std::string& worker_id, const std::string& task_id, const std::string& res, const std::string& cert, const std::string& time);
+    void flush();
+    void drain();
+    void wait();
+    bool empty();
+
+private:
+    std::vector<std::string> pending();
+    bool read(const std::string& filename, std::vector<std::string>& fields);
+    bool post(restc_cpp::Context& ctx, std::vector<std::string>& fields, const std::string& filename);
+
+private:
+    std::string _dir;
+    restc_cpp::RestClient* _client;
+    std::string _url;
+    std::mutex _mutex;
+    std::shared_future<void> _flushF;
+    std::deque<std::vector<std::string>> _unspooled;
 };
 
 class RequestBodyData : public restc_cpp::RequestBody
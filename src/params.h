@@ -17,13 +17,24 @@ public:
     std::optional<int> StrongCount;
     std::optional<int> StrongL;
     std::optional<int> StrongL2;
+    std::optional<int> StrongRing;
+    std::optional<bool> StrongAdaptive;
+    std::optional<bool> StrongLean;
 
     std::optional<int> SlidingWindow;
+    std::optional<bool> ReferenceKernel;
+
+    std::optional<int> InterimIterations;
+    std::optional<int> InterimPercent;
+    std::optional<bool> InterimPow2;
+    std::string InterimCompareFilename;
 
     std::optional<int> FermatBase;
+    std::optional<bool> AuxParallel;
 
     std::string ProofPointFilename;
     std::string ProofProductFilename;
+    std::optional<bool> ProofContainer;
     std::optional<int> ProofPointsPerCheck;
     std::optional<int> ProofChecksPerPoint;
     std::string ProofSecuritySeed;
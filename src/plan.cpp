@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <algorithm>
+#include "gwnum.h"
+#include "task.h"
+#include "file.h"
+#include "exp.h"
+#include "fermat.h"
+#include "proof.h"
+#include "plan.h"
+
+using namespace arithmetic;
+
+static std::string format_time(double seconds)
+{
+    char buf[32];
+    long long s = (long long)(seconds + 0.5);
+    if (s >= 86400)
+        snprintf(buf, sizeof(buf), "%lldd %02d:%02d:%02d", s/86400, (int)(s/3600%24), (int)(s/60%60), (int)(s%60));
+    else
+        snprintf(buf, sizeof(buf), "%02d:%02d:%02d", (int)(s/3600), (int)(s/60%60), (int)(s%60));
+    return buf;
+}
+
+double Planner::measure(GWState& gwstate)
+{
+    GWArithmetic& gw = gwstate.gwarithmetic();
+    GWNum X(gw);
+    X = 3;
+    int i, count = 0;
+    double elapsed = 0;
+    double timer = getHighResTimer();
+    while (elapsed < 1.0 && !Task::abort_flag())
+    {
+        for (i = 0; i < 100; i++)
+            gw.square(X, X, GWMUL_STARTNEXTFFT_IF(i + 1 < 100));
+        count += 100;
+        elapsed = (getHighResTimer() - timer)/getHighResTimerFrequency();
+    }
+    return elapsed/count;
+}
+
+Planner::Estimate Planner::estimate(GWState& gwstate, int proof_count, bool strong, size_t base_memory)
+{
+    Estimate estimate;
+    estimate.proof_count = proof_count;
+    estimate.strong = strong;
+
+    // The constructors only compute the schedule, the costs are collected by a silent logger.
+    Params params = _params;
+    params.CheckStrong = strong;
+    params.RootOfUnityCheck = false;
+    Logging logging(Logging::LEVEL_ERROR);
+    File file_cert("prst_plan.cert", 0);
+    std::unique_ptr<Proof> proof;
+    if (proof_count > 0)
+        proof.reset(new Proof(Proof::SAVE, proof_count, _input, params, file_cert, logging));
+    Fermat fermat(Fermat::AUTO, _input, params, logging, proof.get());
+    estimate.cost = logging.progress().cost_total();
+    if (proof)
+    {
+        Proof build(Proof::BUILD, proof_count, _input, params, file_cert, logging);
+        estimate.cost += build.cost();
+        estimate.verify = proof->M()*_mul_time;
+    }
+    else
+        estimate.verify = estimate.cost*_mul_time;
+    estimate.time = estimate.cost*_mul_time;
+
+    MultipointExp* task = fermat.task();
+    int gwnums = 2;
+    if (!task->smooth())
+        gwnums += ExpRecoding::optimal_table_size(task->exp().bitlen(), task->_W, -1);
+    if (strong)
+        gwnums += params.StrongLean && params.StrongLean.value() ? 1 : 3;
+    if (proof)
+        gwnums = std::max(gwnums, proof->depth() + 3);
+    estimate.memory = base_memory + gwnums*gwnum_size(gwstate.gwdata());
+
+    size_t residue = _input.bitlen()/8 + 32;
+    size_t checkpoint = strong ? 2*residue : residue;
+    size_t proof_files = proof ? (proof_count + 1 + proof->depth() + 1)*residue : 0;
+    int checks = params.StrongCount ? params.StrongCount.value() : proof ? proof_count : 16;
+    estimate.disk = (strong ? 2 : 1)*checkpoint + proof_files;
+    if (strong && params.StrongRing)
+        estimate.disk += params.StrongRing.value()*checkpoint;
+    estimate.upload = (size_t)(estimate.time/std::max(Task::DISK_WRITE_TIME, 1) + 1)*checkpoint + (strong ? checks*checkpoint : 0) + proof_files;
+
+    return estimate;
+}
+
+void Planner::run(GWState& gwstate, Logging& logging, size_t base_memory)
+{
+    _mul_time = measure(gwstate);
+    logging.info("Planning %s on %s, %.3f ms per multiplication.\n", _input.display_text().data(), gwstate.fft_description.data(), _mul_time*1000);
+
+    _estimates.clear();
+    for (bool strong : {false, true})
+        for (int count = 0; count <= 4096; count = count == 0 ? 16 : count*4)
+            if (count == 0 || count*64 <= _input.bitlen())
+                _estimates.push_back(estimate(gwstate, count, strong, base_memory));
+
+    logging.info("%-12s %-8s %14s %10s %10s %10s %14s %14s\n", "proof", "check", "time", "memory", "disk", "upload", "verify", "total");
+    for (auto& e : _estimates)
+    {
+        std::string proof = e.proof_count > 0 ? "save " + std::to_string(e.proof_count) : "none";
+        logging.info("%-12s %-8s %14s %7d MB %7d MB %7d MB %14s %14s\n", proof.data(), e.strong ? "strong" : "default",
+            format_time(e.time).data(), (int)(e.memory >> 20), (int)(e.disk >> 20), (int)(e.upload >> 20), format_time(e.verify).data(), format_time(e.total()).data());
+    }
+
+    auto best = std::min_element(_estimates.begin(), _estimates.end(), [](Estimate& a, Estimate& b) { return a.total() < b.total(); });
+    std::string options;
+    if (best->proof_count > 0)
+        options += " -proof save " + std::to_string(best->proof_count);
+    if (best->strong)
+        options += " -check strong";
+    logging.info("Recommended:%s.\n", !options.empty() ? options.data() : " no proof, default checks");
+}
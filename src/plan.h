@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include "arithmetic.h"
+#include "inputnum.h"
+#include "logging.h"
+#include "params.h"
+
+// Predicts the resources of a test for several -proof save and -check strong settings.
+class Planner
+{
+public:
+    struct Estimate
+    {
+        int proof_count;
+        bool strong;
+        double cost;
+        double time;
+        double verify;
+        size_t memory;
+        size_t disk;
+        size_t upload;
+        double total() { return time + verify; }
+    };
+
+public:
+    Planner(InputNum& input, const Params& params) : _input(input), _params(params) { }
+
+    void run(arithmetic::GWState& gwstate, Logging& logging, size_t base_memory);
+
+    std::vector<Estimate>& estimates() { return _estimates; }
+    double mul_time() { return _mul_time; }
+
+protected:
+    double measure(arithmetic::GWState& gwstate);
+    Estimate estimate(arithmetic::GWState& gwstate, int proof_count, bool strong, size_t base_memory);
+
+protected:
+    InputNum& _input;
+    Params _params;
+    double _mul_time = 0;
+    std::vector<Estimate> _estimates;
+};
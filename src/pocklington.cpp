@@ -161,7 +161,7 @@ void Pocklington::run(InputNum& input, arithmetic::GWState& gwstate, File& file_
             if (dynamic_cast<FastExp*>(_task.get()) != nullptr)
             {
                 double fft_count = gwstate.handle.fft_count;
-                gwstate.done();
+                GWScratchPool::done(gwstate);
                 gwstate.maxmulbyconst = _a;
                 input.setup(gwstate);
                 gwstate.handle.fft_count = fft_count;
@@ -10,6 +10,10 @@
 
 using namespace arithmetic;
 
+void hash_giants(uint32_t fingerprint, Giant& gin1, Giant& gin2, Giant& gout);
+void make_prime(Giant& g, int limit);
+void exp_gw(GWArithmetic& gw, Giant& exp, GWNum& X, GWNum& X0, int options);
+
 Proof::Proof(int op, int count, InputNum& input, Params& params, File& file_cert, Logging& logging, std::optional<bool> forceLi) : _op(op), _count(count)
 {
     if ((op == SAVE || op == BUILD) && (count & (count - 1)) != 0)
@@ -21,11 +25,28 @@ Proof::Proof(int op, int count, InputNum& input, Params& params, File& file_cert
     bool CheckStrong = params.CheckStrong ? params.CheckStrong.value() : false;
     _Li = forceLi ? forceLi.value() : input.b() != 2;
 
+    if (op == WESOLOWSKI)
+    {
+        _count = 0;
+        _wesolowski_count = count > 0 ? count : 64;
+        _check_strong = CheckStrong;
+    }
+
     if (op == SAVE)
         _task.reset(new ProofSave(*this));
     if (op == BUILD)
         _task.reset(new ProofBuild(*this, params.ProofSecuritySeed));
-    if (op == CERT)
+    WesolowskiCertificate wcert;
+    if (op == CERT && file_cert.read(wcert))
+    {
+        file_cert.free_buffer();
+        _M = wcert.iterations();
+        _wesolowski_a = wcert.a();
+        _r_count = std::move(wcert.pi());
+        _r_0 = std::move(wcert.x());
+        _challenge = std::move(wcert.l());
+    }
+    else if (op == CERT)
     {
         Certificate cert;
         if (!file_cert.read(cert) || (Li() && cert.a_power() == 0))
@@ -133,39 +154,51 @@ void Proof::calc_points(int iterations, InputNum& input, Params& params, Logging
     }
     else
     {
-        _points.reserve(_count + 1);
-        _points.push_back(0);
-        for (int i = 1; i < _count; i++)
+        _M = schedule(_count, iterations, points_per_check, _points);
+        _binary = true;
+    }
+    logging.report_param("M", _M);
+}
+
+int Proof::schedule(int count, int iterations, int points_per_check, std::vector<int>& points)
+{
+    int M = 0;
+    points.clear();
+    points.reserve(count + 1);
+    points.push_back(0);
+    for (int i = 1; i < count; i++)
+    {
+        M = iterations;
+        points.push_back(0);
+        for (int j = count/2; j > 0 && (i & (j*2 - 1)) != 0; j >>= 1)
         {
-            _M = iterations;
-            _points.push_back(0);
-            for (int j = _count/2; j > 0 && (i & (j*2 - 1)) != 0; j >>= 1)
-            {
-                _M /= 2;
-                if ((i & j) != 0)
-                    _points.back() += _M;
-                if ((iterations & (_count/j/2)) != 0)
-                    _points.back()++;
-            }
-            if (i%points_per_check != 0)
-                _points.back() *= -1;
+            M /= 2;
+            if ((i & j) != 0)
+                points.back() += M;
+            if ((iterations & (count/j/2)) != 0)
+                points.back()++;
         }
-        _points.push_back(iterations);
+        if (i%points_per_check != 0)
+            points.back() *= -1;
     }
-    logging.report_param("M", _M);
+    points.push_back(iterations);
+    return M;
 }
 
 void Proof::init_files(File* file_point, File* file_product, File* file_cert)
 {
     int i;
+    _file_point = file_point;
     _file_points.clear();
     _file_points.reserve(_count + 1);
-    for (i = 0; i <= _count; i++)
-        _file_points.push_back(file_point->add_child(std::to_string(i), file_point->fingerprint()));
+    if (file_point != nullptr)
+        for (i = 0; i <= _count; i++)
+            _file_points.push_back(file_point->add_child(std::to_string(i), file_point->fingerprint()));
     _file_products.clear();
     if (file_product != nullptr)
         for (i = 0; (1 << i) < _count; i++)
             _file_products.push_back(file_product->add_child(std::to_string(i), file_product->fingerprint()));
+    _file_level = file_product != nullptr ? file_product->add_child("l", file_product->fingerprint()) : nullptr;
     _file_cert = file_cert;
 }
 
@@ -173,6 +206,20 @@ void Proof::init_state(MultipointExp* task, arithmetic::GWState& gwstate, InputN
 {
     std::unique_ptr<BaseExp::State> state(new BaseExp::State());
 
+    if (op() == WESOLOWSKI)
+    {
+        if (input.b() != 2 || _check_strong)
+        {
+            logging.error("Wesolowski proof requires b = 2 and no strong check.\n");
+            throw TaskAbortException();
+        }
+        _taskW = dynamic_cast<WesolowskiExp*>(task);
+        GWASSERT(_taskW != nullptr);
+        _wesolowski_a = a;
+        logging.info("Saving %d Wesolowski checkpoints, k = %d.\n", _taskW->count(), _taskW->k());
+        return;
+    }
+
     if (op() == BUILD)
     {
         logging.info("Building certificate from %d products.\n", depth());
@@ -209,6 +256,8 @@ void Proof::init_state(MultipointExp* task, arithmetic::GWState& gwstate, InputN
     }
 
     logging.info("Saving %d proof points.\n", count());
+    if (reconcile_points(task, logging))
+        return;
     int point = _count;
     while (point >= 0)
     {
@@ -224,6 +273,93 @@ void Proof::init_state(MultipointExp* task, arithmetic::GWState& gwstate, InputN
         task->init_state(nullptr);
 }
 
+bool Proof::reconcile_points(MultipointExp* task, Logging& logging)
+{
+    int i, j;
+    if (!_binary || _file_point == nullptr)
+        return false;
+    for (i = 1; i < _count && _points[i] < 0; i++);
+    BaseExp::State state;
+    if (!_file_points[i]->read(state) || state.iteration() == abs(_points[i]))
+        return false;
+    _file_points[i]->free_buffer();
+
+    // The points were saved with a different count, the schedule is recovered from the iteration of the same index.
+    int old_count;
+    std::vector<int> old_points;
+    for (old_count = 2; old_count <= MAX_COUNT; old_count <<= 1)
+    {
+        if (old_count == _count || old_count < i)
+            continue;
+        schedule(old_count, _points[_count], 1, old_points);
+        if (old_points[i] == state.iteration())
+            break;
+    }
+    if (old_count > MAX_COUNT)
+    {
+        logging.warning("Proof points do not match the schedule of %d points.\n", _count);
+        return false;
+    }
+
+    // Schedules of power of 2 counts are nested, a smaller count keeps all points.
+    std::vector<int> old_index(_count + 1, -1);
+    for (i = 0; i <= _count; i++)
+        for (j = 0; j <= old_count && _points[i] >= 0; j++)
+            if (old_points[j] == _points[i])
+                old_index[i] = j;
+    int iteration = task->state() != nullptr ? task->state()->iteration() : -1;
+    for (i = 1; i <= _count && (_points[i] < 0 || old_index[i] >= 0 || _points[i] > iteration); i++);
+    if (i <= _count)
+    {
+        logging.error("Proof points were saved with count %d, count %d needs points that were not saved. Use -proof save %d to continue.\n", old_count, _count, old_count);
+        throw TaskAbortException();
+    }
+    logging.info("Proof points were saved with count %d, rearranging.\n", old_count);
+
+    std::vector<File*> old_files(old_count + 1);
+    for (j = 0; j <= old_count; j++)
+        old_files[j] = j <= _count ? _file_points[j] : _file_point->add_child(std::to_string(j), _file_point->fingerprint());
+    // Ascending order when the count decreases, old_index[i] >= i, a point is read before it is overwritten.
+    std::vector<bool> valid(_count + 1, false);
+    for (int k = 0; k <= _count; k++)
+    {
+        i = old_count > _count ? k : _count - k;
+        j = old_index[i];
+        if (_points[i] < 0 || (i == 0 && Li()))
+            valid[i] = true;
+        else if (j >= 0 && old_files[j]->read(state) && state.iteration() == _points[i])
+        {
+            if (j != i)
+                _file_points[i]->write(state);
+            _file_points[i]->free_buffer();
+            old_files[j]->free_buffer();
+            valid[i] = true;
+        }
+    }
+    for (j = _count + 1; j <= old_count; j++)
+        old_files[j]->clear();
+
+    // The run resumes from the checkpoint only if no point before it is missing.
+    int last = -1;
+    for (i = 0; i <= _count && valid[i]; i++)
+        if (_points[i] >= 0)
+            last = i;
+    if (last >= 0 && iteration >= _points[last] && (i > _count || iteration < _points[i]))
+        return true;
+
+    if (iteration > (last >= 0 ? _points[last] : 0))
+        logging.warning("%d iterations are lost, resuming from proof point %d.\n", iteration - (last >= 0 ? _points[last] : 0), std::max(last, 0));
+    if (last > 0 || (last == 0 && !Li()))
+    {
+        _file_points[last]->read(state);
+        _file_points[last]->free_buffer();
+        task->init_state(new BaseExp::State(state.iteration(), std::move(state.X())));
+    }
+    else if (task->state() != nullptr)
+        task->init_state(nullptr);
+    return true;
+}
+
 void Proof::read_point(int index, TaskState& state, Logging& logging)
 {
     if (!_file_points[index]->read(state) || state.iteration() != abs(_points[index]))
@@ -246,7 +382,7 @@ void Proof::read_product(int index, TaskState& state, Logging& logging)
 
 bool Proof::on_point(int index, arithmetic::Giant& X)
 {
-    if (index > _count)
+    if (index > _count || op() == WESOLOWSKI)
         return false;
     BaseExp::State state(abs(_points[index]), std::move(X));
     _file_points[index]->write(state);
@@ -260,6 +396,46 @@ void Proof::run(InputNum& input, arithmetic::GWState& gwstate, File& file_checkp
 {
     double timer = 0;
     Giant tail;
+    if (!_challenge.empty())
+    {
+        // y = pi^l*x^(2^M mod l)
+        logging.info("Verifying Wesolowski certificate of %s, %d iterations.\n", input.display_text().data(), _M);
+        timer = getHighResTimer();
+        Giant r, exp;
+        r = _wesolowski_a;
+        r.arithmetic().powermod(r, input.gk(), *gwstate.N, r);
+        if (r != _r_0)
+        {
+            logging.error("invalid a^k.\n");
+            throw TaskAbortException();
+        }
+        r = 2;
+        exp = _M;
+        r.arithmetic().powermod(r, exp, _challenge, r);
+        GWArithmetic& gw = gwstate.gwarithmetic().carefully();
+        GWNum X(gw);
+        GWNum Y(gw);
+        GWNum T(gw);
+        X = _r_count;
+        exp_gw(gw, _challenge, X, T = X, 0);
+        Y = _r_0;
+        exp_gw(gw, r, Y, T = Y, 0);
+        gw.mul(Y, X, X, 0);
+        r = X;
+        // l is bound to the result, pi can not be chosen for a given l.
+        WesolowskiExp::hash_challenge(gwstate.fingerprint, _r_0, r, _M, exp);
+        if (exp != _challenge)
+        {
+            logging.error("%s Wesolowski certificate is invalid.\n", input.display_text().data());
+            throw TaskAbortException();
+        }
+        timer = (getHighResTimer() - timer)/getHighResTimerFrequency();
+
+        _res64 = r.to_res64();
+        logging.result(false, "%s certificate RES64: %s, time: %.1f s.\n", input.display_text().data(), _res64.data(), timer);
+        logging.result_save(input.input_text() + " certificate RES64: " + _res64 + ", time: " + std::to_string((int)timer) + " s.\n");
+        return;
+    }
     if (Li())
     {
         File* file_checkpoint_a(file_checkpoint.add_child("a", file_checkpoint.fingerprint()));
@@ -320,6 +496,20 @@ void Proof::run(InputNum& input, arithmetic::GWState& gwstate, Logging& logging,
             throw TaskAbortException();
         }
     }
+    if (_taskW != nullptr && _taskW->accumulator() != nullptr && !_taskW->accumulator()->pi().empty())
+    {
+        WesolowskiCertificate cert;
+        cert.set(_taskW->T(), _wesolowski_a, _taskW->accumulator()->pi(), _taskW->accumulator()->x(), _taskW->challenge());
+        _file_cert->write(cert);
+        _file_cert->free_buffer();
+        _taskW->clear_files();
+
+        _res64 = _taskW->accumulator()->y().to_res64();
+        logging.result(false, "%s certificate RES64: %s.\n", input.display_text().data(), _res64.data());
+        logging.result_save(input.input_text() + " certificate RES64: " + _res64 + ".\n");
+    }
+    else if (_taskW != nullptr)
+        logging.error("%s Wesolowski certificate was not built.\n", input.display_text().data());
     ProofSave* taskSave = dynamic_cast<ProofSave*>(_task.get());
     if (taskSave != nullptr)
     {
@@ -378,6 +568,71 @@ void ProofSave::read_point(int index, TaskState& state)
     _proof.read_point(index, state, *_logging);
 }
 
+bool Proof::Level::read(Reader& reader)
+{
+    int count;
+    if (!TaskState::read(reader) || !reader.read(_depth) || !reader.read(count) || count < 0 || count > _depth)
+        return false;
+    _nodes.resize(count);
+    for (auto& node : _nodes)
+        if (!reader.read(node))
+            return false;
+    return true;
+}
+
+void Proof::Level::write(Writer& writer)
+{
+    TaskState::write(writer);
+    writer.write(_depth);
+    writer.write((int)_nodes.size());
+    for (auto& node : _nodes)
+        writer.write(node);
+}
+
+// Before point j of level depth is folded in, tree[m] is pending iff bit (depth - 1 - m) of j is set.
+int ProofSave::restore_level(int depth, std::vector<GWScratch>& tree)
+{
+    Proof::Level level;
+    File* file = _proof.file_level();
+    if (file == nullptr || !file->read(level))
+        return 0;
+    file->free_buffer();
+    int j = level.iteration();
+    if (level.depth() != depth || j <= 0 || j >= (1 << depth))
+        return 0;
+    size_t n = 0;
+    for (int m = 0; m < depth; m++)
+        if (j & (1 << (depth - 1 - m)))
+        {
+            if (n == level.nodes().size())
+                return 0;
+            *tree[m] = level.nodes()[n++];
+            gw().fft(*tree[m], *tree[m]);
+        }
+    if (n != level.nodes().size())
+        return 0;
+    _logging->info("resuming product %d at point %d of %d.\n", depth, j, 1 << depth);
+    return j;
+}
+
+void ProofSave::write_level(int depth, int index, std::vector<GWScratch>& tree)
+{
+    File* file = _proof.file_level();
+    if (file == nullptr)
+        return;
+    Proof::Level level;
+    level.set(depth, index);
+    for (int m = 0; m < depth; m++)
+        if (index & (1 << (depth - 1 - m)))
+        {
+            level.nodes().emplace_back();
+            level.nodes().back() = *tree[m];
+        }
+    file->write(level);
+    file->free_buffer();
+    _last_write = std::chrono::system_clock::now();
+}
+
 void hash_giant(Giant& gin, Giant& gout)
 {
     MD5_CTX context;
@@ -432,7 +687,7 @@ void ProofSave::execute()
     GWNum Y(gw());
     GWNum D(gw());
     GWNum T(gw());
-    std::vector<GWNum> tree;
+    std::vector<GWScratch> tree;
     std::vector<Giant> h;
 
     t = _proof.depth();
@@ -467,9 +722,15 @@ void ProofSave::execute()
             else
             {
                 while (tree.size() < i)
-                    tree.emplace_back(gw());
-                for (j = 0; j < (1 << i); j++)
+                    tree.emplace_back(*_gwstate);
+                _last_write = std::chrono::system_clock::now();
+                for (j = restore_level(i, tree); j < (1 << i); j++)
                 {
+                    bool abort = Task::abort_flag();
+                    if (j > 0 && (abort || std::chrono::duration<double>(std::chrono::system_clock::now() - _last_write).count() >= Task::DISK_WRITE_TIME))
+                        write_level(i, j, tree);
+                    if (abort)
+                        throw TaskAbortException();
                     k = (1 + j*2) << (t - i - 1);
                     read_point(k, state_d);
                     D = state_d.X();
@@ -480,12 +741,12 @@ void ProofSave::execute()
                             throw TaskAbortException();
                         if ((j & (1 << (k - 1))) == 0)
                         {
-                            gw().fft(D, tree[i - k]);
+                            gw().fft(D, *tree[i - k]);
                             break;
                         }
                         else
                         {
-                            exp_gw(gw(), h[i - k], T = tree[i - k], tree[i - k], GWMUL_STARTNEXTFFT);
+                            exp_gw(gw(), h[i - k], T = *tree[i - k], *tree[i - k], GWMUL_STARTNEXTFFT);
                             gw().mul(T, D, D, GWMUL_STARTNEXTFFT_IF(j + 1 != (1 << i) || k != i));
                         }
                     }
@@ -497,6 +758,8 @@ void ProofSave::execute()
             state_d.mimic_type(Proof::Product::TYPE);
             _proof.file_products()[i]->write(state_d);
             _proof.file_products()[i]->free_buffer();
+            if (_proof.file_level() != nullptr)
+                _proof.file_level()->clear();
         }
 
         h.emplace_back(GiantsArithmetic::default_arithmetic(), 4);
@@ -15,6 +15,8 @@ public:
     static const int BUILD = 2;
     static const int CERT = 3;
     static const int ROOT = 4;
+    static const int WESOLOWSKI = 5;
+    static const int MAX_COUNT = 1 << 16;
 
 public:
     class Product : public TaskState
@@ -51,6 +53,26 @@ public:
         arithmetic::Giant _a_power;
         arithmetic::Giant _a_base;
     };
+    class WesolowskiCertificate : public TaskState
+    {
+    public:
+        static const char TYPE = 9;
+        WesolowskiCertificate() : TaskState(TYPE) { }
+        void set(int iterations, int a, arithmetic::Giant& pi, arithmetic::Giant& x, arithmetic::Giant& l) { TaskState::set(iterations); _a = a; _pi = pi; _x = x; _l = l; }
+        int iterations() { return _iteration; }
+        int a() { return _a; }
+        arithmetic::Giant& pi() { return _pi; }
+        arithmetic::Giant& x() { return _x; }
+        arithmetic::Giant& l() { return _l; }
+        bool read(Reader& reader) override { return TaskState::read(reader) && reader.read(_a) && reader.read(_pi) && reader.read(_x) && reader.read(_l); }
+        void write(Writer& writer) override { TaskState::write(writer); writer.write(_a); writer.write(_pi); writer.write(_x); writer.write(_l); }
+
+    private:
+        int _a = 0;
+        arithmetic::Giant _pi;
+        arithmetic::Giant _x;
+        arithmetic::Giant _l;
+    };
     class State : public TaskState
     {
     public:
@@ -75,6 +97,21 @@ public:
         arithmetic::Giant _exp;
         std::vector<arithmetic::Giant> _h;
     };
+    class Level : public TaskState
+    {
+    public:
+        static const char TYPE = 10;
+        Level() : TaskState(TYPE) { }
+        void set(int depth, int index) { TaskState::set(index); _depth = depth; _nodes.clear(); }
+        int depth() { return _depth; }
+        std::vector<arithmetic::Giant>& nodes() { return _nodes; }
+        bool read(Reader& reader) override;
+        void write(Writer& writer) override;
+
+    private:
+        int _depth = 0;
+        std::vector<arithmetic::Giant> _nodes;
+    };
 
 
 public:
@@ -83,17 +120,20 @@ public:
     void calc_points(int iterations, InputNum& input, Params& params, Logging& logging);
     void init_files(File* file_point, File* file_product, File* file_cert);
     void init_state(MultipointExp* task, arithmetic::GWState& gwstate, InputNum& input, Logging& logging, int a);
+    bool reconcile_points(MultipointExp* task, Logging& logging);
     void read_point(int index, TaskState& state, Logging& logging);
     void read_product(int index, TaskState& state, Logging& logging);
     bool on_point(int index, arithmetic::Giant& X);
     void run(InputNum& input, arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging);
     void run(InputNum& input, arithmetic::GWState& gwstate, Logging& logging, arithmetic::Giant* X);
     double cost();
+    static int schedule(int count, int iterations, int points_per_check, std::vector<int>& points);
 
     int op() { return _op; }
     int count() { return _count; }
     bool Li() { return _Li; }
     int depth() { int t; for (t = 0; (1 << t) < _count; t++); return t; }
+    int wesolowski_count() { return _wesolowski_count; }
     std::vector<int>& points() { return _points; }
     int M() { return _M; }
     void set_cache_points(bool value) { _cache_points = value; }
@@ -104,6 +144,7 @@ public:
     std::vector<File*>& file_points() { return _file_points; }
     std::vector<File*>& file_products() { return _file_products; }
     File* file_cert() { return _file_cert; }
+    File* file_level() { return _file_level; }
     arithmetic::Giant& r_0() { return _r_0; }
     arithmetic::Giant& r_count() { return _r_count; }
     arithmetic::Giant& r_exp() { return *_r_exp; }
@@ -117,12 +158,20 @@ protected:
     std::vector<int> _points;
     int _M = 0;
     bool _cache_points = false;
+    bool _binary = false;
+    File* _file_point = nullptr;
     std::vector<File*> _file_points;
     std::vector<File*> _file_products;
     File* _file_cert = nullptr;
+    File* _file_level = nullptr;
     arithmetic::Giant _r_0;
     arithmetic::Giant _r_count;
     arithmetic::Giant* _r_exp;
+    int _wesolowski_count = 0;
+    int _wesolowski_a = 0;
+    bool _check_strong = false;
+    arithmetic::Giant _challenge;
+    WesolowskiExp* _taskW = nullptr;
     std::unique_ptr<InputTask> _task;
     std::unique_ptr<MultipointExp> _taskA;
     std::unique_ptr<CarefulExp> _taskRoot;
@@ -146,6 +195,8 @@ protected:
     void execute() override;
     void done() override;
     void read_point(int index, TaskState& state);
+    int restore_level(int depth, std::vector<GWScratch>& tree);
+    void write_level(int depth, int index, std::vector<GWScratch>& tree);
 
 protected:
     Proof& _proof;
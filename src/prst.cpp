@@ -17,6 +17,8 @@
 #include "pocklington.h"
 #include "testing.h"
 #include "support.h"
+#include "container.h"
+#include "plan.h"
 #include "version.h"
 #ifdef BOINC
 #include "boinc.h"
@@ -53,16 +55,24 @@ int main(int argc, char *argv[])
     //  4 certificate
     //  5 strong check placeholder
     //  6 proof state
+    //  7 strong check recovery ring
+    //  8 Wesolowski accumulator
+    //  9 Wesolowski certificate
+    // 10 proof partial level
 
     int i;
     GWState gwstate;
+    GWScratchPool scratch(gwstate);
     Params params;
     uint64_t maxMem = 0;
     int proof_op = Proof::NO_OP;
     int proof_count = 0;
     std::string proof_cert;
     bool supportLLR2 = false;
+    bool journal = false;
+    bool crc32c = false;
     bool force_fermat = false;
+    bool plan = false;
     InputNum input;
     int log_level = Logging::LEVEL_WARNING;
 
@@ -192,6 +202,16 @@ int main(int argc, char *argv[])
                         proof_op = Proof::BUILD;
                         proof_count = atoi(argv[i]);
                     }
+                    else if (i < argc - 1 && strcmp(argv[i + 1], "wesolowski") == 0)
+                    {
+                        i++;
+                        proof_op = Proof::WESOLOWSKI;
+                        if (i < argc - 1 && isdigit(argv[i + 1][0]))
+                        {
+                            i++;
+                            proof_count = atoi(argv[i]);
+                        }
+                    }
                     else if (i < argc - 2 && strcmp(argv[i + 1], "cert") == 0)
                     {
                         i += 2;
@@ -210,6 +230,11 @@ int main(int argc, char *argv[])
                             proof_cert = argv[i];
                         }
                     }
+                    else if (i < argc - 1 && strcmp(argv[i + 1], "container") == 0)
+                    {
+                        i++;
+                        params.ProofContainer = true;
+                    }
                     else if (i < argc - 2 && strcmp(argv[i + 1], "security") == 0)
                     {
                         i += 2;
@@ -265,6 +290,21 @@ int main(int argc, char *argv[])
                             i += 2;
                             params.StrongL2 = atoi(argv[i]);
                         }
+                        if (i < argc - 2 && strcmp(argv[i + 1], "ring") == 0)
+                        {
+                            i += 2;
+                            params.StrongRing = atoi(argv[i]);
+                        }
+                        if (i < argc - 1 && strcmp(argv[i + 1], "adaptive") == 0)
+                        {
+                            i++;
+                            params.StrongAdaptive = true;
+                        }
+                        if (i < argc - 1 && strcmp(argv[i + 1], "lean") == 0)
+                        {
+                            i++;
+                            params.StrongLean = true;
+                        }
                     }
                     else
                         break;
@@ -275,6 +315,33 @@ int main(int argc, char *argv[])
                 if (strcmp(argv[i], "LLR2") == 0)
                     supportLLR2 = true;
             }
+            else if (i < argc - 1 && strcmp(argv[i], "-interim") == 0)
+            {
+                i++;
+                if (strcmp(argv[i], "pow2") == 0)
+                    params.InterimPow2 = true;
+                else if (argv[i][0] != 0 && argv[i][strlen(argv[i]) - 1] == '%')
+                    params.InterimPercent = atoi(argv[i]);
+                else
+                    params.InterimIterations = atoi(argv[i]);
+                if (i < argc - 2 && strcmp(argv[i + 1], "compare") == 0)
+                {
+                    i += 2;
+                    params.InterimCompareFilename = argv[i];
+                }
+            }
+            else if (i < argc - 1 && strcmp(argv[i], "-aux") == 0)
+            {
+                i++;
+                if (strcmp(argv[i], "parallel") == 0)
+                    params.AuxParallel = true;
+            }
+            else if (strcmp(argv[i], "-journal") == 0)
+                journal = true;
+            else if (strcmp(argv[i], "-crc32c") == 0)
+                crc32c = true;
+            else if (strcmp(argv[i], "-plan") == 0)
+                plan = true;
             else if (strcmp(argv[i], "-fermat") == 0)
             {
                 force_fermat = true;
@@ -343,16 +410,19 @@ int main(int argc, char *argv[])
     {
         printf("Usage: PRST {\"K*B^N+C\" | \"N!+C\" | \"N#+C\" | \"N\"} <options>\n");
         printf("Options: [-log {debug | info | warning | error}]\n");
-        printf("\t[-t <threads>] [-spin <threads>]\n");
-        printf("\t[-time [write <sec>] [progress <sec>]]\n");
+        printf("\t[-t <threads>] [-spin <threads>] [-M <memory>]\n");
+        printf("\t[-time [write <sec>] [progress <sec>]] [-journal] [-crc32c]\n");
         printf("\t[-fft+1] [-fft [+<inc>] [safety <margin>] [info]] [-cpu {SSE2 | AVX | FMA3 | AVX512F}]\n");
+        printf("\t[-plan]\n");
         printf("\t-fermat [a <a>] \n");
-        printf("\t-proof {save <count> | build <count> [security <seed>] [roots <depth>] | cert {<name> | default}} [name <proof> <product> [{<cert> | default}]]\n");
-        printf("\t-check [{near | always| never}] [strong [count <count>] [L <L>]] \n");
+        printf("\t[-aux parallel]\n");
+        printf("\t-proof {save <count> | build <count> [security <seed>] [roots <depth>] | wesolowski [<count>] | cert {<name> | default}} [name <proof> <product> [{<cert> | default}]] [container]\n");
+        printf("\t-check [{near | always| never}] [strong [count <count>] [L <L>] [ring <count>] [adaptive] [lean]] \n");
+        printf("\t[-interim {<iterations> | <percent>%% | pow2} [compare <file>]]\n");
         return 0;
     }
 
-    Logging logging(gwstate.information_only && log_level > Logging::LEVEL_INFO ? Logging::LEVEL_INFO : log_level);
+    Logging logging((gwstate.information_only || plan) && log_level > Logging::LEVEL_INFO ? Logging::LEVEL_INFO : log_level);
 
     if (input.bitlen() < 32)
     {
@@ -372,6 +442,7 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    std::unique_ptr<Container> proof_container;
     std::unique_ptr<File> file_proofpoint;
     std::unique_ptr<File> file_proofproduct;
     std::unique_ptr<File> file_cert;
@@ -386,6 +457,10 @@ int main(int argc, char *argv[])
     uint32_t fingerprint = input.fingerprint();
     gwstate.fingerprint = fingerprint;
     newFile(file_cert, !proof_cert.empty() && proof_cert != "default" ? proof_cert : "prst_" + std::to_string(fingerprint) + ".cert", fingerprint, Proof::Certificate::TYPE);
+    // The planner takes the options before the test adjusts them.
+    std::unique_ptr<Planner> planner;
+    if (plan)
+        planner.reset(new Planner(input, params));
     std::unique_ptr<Proof> proof;
     if (proof_op != Proof::NO_OP)
         proof.reset(new Proof(proof_op, proof_count, input, params, *file_cert, logging));
@@ -415,45 +490,138 @@ int main(int argc, char *argv[])
     gwstate.maxmulbyconst = params.maxmulbyconst;
     input.setup(gwstate);
     logging.info("Using %s.\n", gwstate.fft_description.data());
+    if (fermat && maxMem > 0)
+        fermat->task()->set_max_size((int)(maxMem/gwnum_size(gwstate.gwdata())));
+
+    if (planner)
+    {
+        planner->run(gwstate, logging, peak_memory());
+        GWScratchPool::done(gwstate);
+        return 0;
+    }
 
     try
     {
-        File file_progress("prst_" + std::to_string(gwstate.fingerprint), fingerprint);
-        file_progress.hash = false;
-        logging.progress_file(&file_progress);
+        std::unique_ptr<Container> container;
+        if (journal)
+            container.reset(new Container("prst_" + std::to_string(gwstate.fingerprint) + ".j", logging, 64 + (proof_op == Proof::WESOLOWSKI ? proof->wesolowski_count() : 0), 2, crc32c ? Container::HASH_CRC32C : Container::HASH_MD5));
+        auto newStateFile = [&](std::unique_ptr<File>& file, const std::string& suffix, uint32_t fingerprint)
+        {
+            if (container)
+                file.reset(new ContainerFile(*container, !suffix.empty() ? suffix.substr(1) : "progress", fingerprint));
+            else
+                file.reset(new File("prst_" + std::to_string(gwstate.fingerprint) + suffix, fingerprint));
+        };
+
+        std::unique_ptr<File> file_progress;
+        std::unique_ptr<File> file_checkpoint;
+        std::unique_ptr<File> file_recoverypoint;
+        newStateFile(file_progress, "", fingerprint);
+        file_progress->hash = false;
+        logging.progress_file(file_progress.get());
 
         if (proof_op == Proof::CERT)
         {
             fingerprint = File::unique_fingerprint(fingerprint, file_cert->filename());
-            File file_checkpoint("prst_" + std::to_string(gwstate.fingerprint) + ".cert.c", fingerprint);
-            File file_recoverypoint("prst_" + std::to_string(gwstate.fingerprint) + ".cert.r", fingerprint);
-            proof->run(input, gwstate, file_checkpoint, file_recoverypoint, logging);
+            newStateFile(file_checkpoint, ".cert.c", fingerprint);
+            newStateFile(file_recoverypoint, ".cert.r", fingerprint);
+            proof->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging);
+        }
+        else if (proof && proof_op == Proof::WESOLOWSKI)
+        {
+            proof->init_files(nullptr, nullptr, file_cert.get());
+            newStateFile(file_checkpoint, ".c", fingerprint);
+            newStateFile(file_recoverypoint, ".r", fingerprint);
+            fermat->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging, proof.get());
         }
         else if (proof)
         {
-            fingerprint = File::unique_fingerprint(fingerprint, std::to_string(fermat->a()) + "." + std::to_string(proof->points()[proof_count]));
-            newFile(file_proofpoint, !params.ProofPointFilename.empty() ? params.ProofPointFilename : "prst_" + std::to_string(gwstate.fingerprint) + ".proof", fingerprint);
-            newFile(file_proofproduct, !params.ProofProductFilename.empty() ? params.ProofProductFilename : "prst_" + std::to_string(gwstate.fingerprint) + ".prod", fingerprint, Proof::Product::TYPE);
+            fingerprint = File::unique_fingerprint(fingerprint, std::to_string(fermat->a()) + "." + std::to_string(fermat->iterations()));
+            std::string proof_filename = !params.ProofPointFilename.empty() ? params.ProofPointFilename : "prst_" + std::to_string(gwstate.fingerprint) + ".proof";
+            std::string product_filename = !params.ProofProductFilename.empty() ? params.ProofProductFilename : "prst_" + std::to_string(gwstate.fingerprint) + ".prod";
+            if (params.ProofContainer && params.ProofContainer.value() && !supportLLR2)
+            {
+                proof_container.reset(new Container(proof_filename + "s", logging, proof_count + 64, 1, crc32c ? Container::HASH_CRC32C : Container::HASH_MD5));
+                file_proofpoint.reset(new ContainerFile(*proof_container, "proof", fingerprint));
+                file_proofproduct.reset(new ContainerFile(*proof_container, "prod", fingerprint));
+            }
+            else
+            {
+                newFile(file_proofpoint, proof_filename, fingerprint);
+                newFile(file_proofproduct, product_filename, fingerprint, Proof::Product::TYPE);
+            }
             proof->init_files(file_proofpoint.get(), file_proofproduct.get(), file_cert.get());
+            if (proof_container)
+            {
+                int imported = 0;
+                auto migrate = [&](File* file, const std::string& filename)
+                {
+                    for (int i = 0; i < (int)file->children().size(); i++)
+                    {
+                        File* child = file->children()[i].get();
+                        proof_container->reserve(child->filename(), input.bitlen()/8 + 64);
+                        File file_legacy(filename + "." + std::to_string(i), child->fingerprint());
+                        if (proof_container->import(child->filename(), file_legacy))
+                            imported++;
+                    }
+                };
+                migrate(file_proofpoint.get(), proof_filename);
+                migrate(file_proofproduct.get(), product_filename);
+                if (imported > 0)
+                    logging.info("Moved %d proof files to %s.\n", imported, proof_container->filename().data());
+            }
 
-            File file_checkpoint("prst_" + std::to_string(gwstate.fingerprint) + ".c", fingerprint);
-            File file_recoverypoint("prst_" + std::to_string(gwstate.fingerprint) + ".r", fingerprint);
-            fermat->run(input, gwstate, file_checkpoint, file_recoverypoint, logging, proof.get());
+            newStateFile(file_checkpoint, ".c", fingerprint);
+            newStateFile(file_recoverypoint, ".r", fingerprint);
+            fermat->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging, proof.get());
+            if (proof_container && proof_op == Proof::SAVE)
+            {
+                // The certificate is built from the end points and the products, the other points are dropped.
+                for (int i = 1; i < proof->count(); i++)
+                    proof->file_points()[i]->clear();
+                proof_container->compact();
+            }
         }
         else if (fermat)
         {
-            File file_checkpoint("prst_" + std::to_string(gwstate.fingerprint) + ".c", fingerprint);
-            File file_recoverypoint("prst_" + std::to_string(gwstate.fingerprint) + ".r", fingerprint);
-            fermat->run(input, gwstate, file_checkpoint, file_recoverypoint, logging, nullptr);
+            // A run started with -proof continues without it if the exponent is the same.
+            uint32_t fingerprint_proof = File::unique_fingerprint(fingerprint, std::to_string(fermat->a()) + "." + std::to_string(fermat->iterations()));
+            BaseExp::State state;
+            std::unique_ptr<File> file_probe;
+            for (auto suffix : {".c", ".r"})
+            {
+                newStateFile(file_probe, suffix, fingerprint_proof);
+                if (file_probe->read(state))
+                {
+                    logging.info("Continuing the test started with -proof, proof points are not saved.\n");
+                    fingerprint = fingerprint_proof;
+                    break;
+                }
+            }
+            if (fingerprint != fingerprint_proof && input.b() == 2 && !fermat->task()->smooth())
+            {
+                newStateFile(file_probe, ".c", File::unique_fingerprint(fingerprint, std::to_string(fermat->a()) + "." + std::to_string(fermat->n())));
+                if (file_probe->read(state))
+                {
+                    logging.error("The test was started with -proof, use the same -proof or -check options to continue it.\n");
+                    throw TaskAbortException();
+                }
+            }
+            newStateFile(file_checkpoint, ".c", fingerprint);
+            newStateFile(file_recoverypoint, ".r", fingerprint);
+            fermat->run(input, gwstate, *file_checkpoint, *file_recoverypoint, logging, nullptr);
         }
 
-        file_progress.clear();
+        file_progress->clear();
+        if (container)
+            container->remove();
     }
     catch (const TaskAbortException&)
     {
     }
 
-    gwstate.done();
+    report_peak_memory(logging);
+    GWScratchPool::done(gwstate);
 
     return 0;
 }
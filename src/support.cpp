@@ -1,11 +1,24 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#include <nmmintrin.h>
+#elif defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#endif
 #include "gwnum.h"
 #include "file.h"
 #include "md5.h"
 #include "inputnum.h"
 #include "task.h"
+#include "logging.h"
 #include "support.h"
 #include "exp.h"
 #include "proof.h"
@@ -38,15 +51,158 @@ void LLR2File::commit_writer(Writer& writer)
         writer.buffer()[6] = 0;
         if (_type == BaseExp::State::TYPE)
             (*(uint32_t*)(writer.buffer().data() + 12))++;
-        writer.write((uint32_t)0);
-        uint32_t checksum = 0;
-        char* end = writer.buffer().data() + writer.buffer().size();
-        for (char* data = writer.buffer().data() + 8; data < end; data += 4)
-            checksum += *(uint32_t*)data;
-        writer.write(checksum);
-        for (int i = 0; i < 20; i++)
-            writer.write((uint32_t)0);
+        llr2_checksum(writer);
     }
 
     File::commit_writer(writer);
 }
+
+// The buffer is processed in blocks small enough to stay in cache between the checksum and the MD5.
+void llr2_checksum(Writer& writer, char* md5hash)
+{
+    const size_t BLOCK_SIZE = 65536;
+    MD5_CTX context;
+    writer.write((uint32_t)0);
+    std::vector<char>& buffer = writer.buffer();
+    if (md5hash != nullptr)
+    {
+        MD5Init(&context);
+        MD5Update(&context, (unsigned char*)buffer.data(), 8);
+    }
+    uint32_t checksum = 0;
+    for (size_t pos = 8; pos < buffer.size(); pos += BLOCK_SIZE)
+    {
+        size_t end = std::min(pos + BLOCK_SIZE, buffer.size());
+        for (size_t i = pos; i < end; i += 4)
+            checksum += *(uint32_t*)(buffer.data() + i);
+        if (md5hash != nullptr)
+            MD5Update(&context, (unsigned char*)buffer.data() + pos, (unsigned int)(end - pos));
+    }
+    size_t tail = buffer.size();
+    writer.write(checksum);
+    for (int i = 0; i < 20; i++)
+        writer.write((uint32_t)0);
+    if (md5hash != nullptr)
+    {
+        MD5Update(&context, (unsigned char*)writer.buffer().data() + tail, (unsigned int)(writer.buffer().size() - tail));
+        md5_hex(md5hash, &context);
+    }
+}
+
+void md5_hex(char* hash_out, MD5_CTX* context)
+{
+    static const char* format = []() {
+        char hash[33];
+        md5_raw_input(hash, (unsigned char*)"", 0);
+        return strpbrk(hash, "ABCDEF") != nullptr ? "%02X" : "%02x";
+    }();
+    unsigned char digest[16];
+    MD5Final(digest, context);
+    for (int i = 0; i < 16; i++)
+        snprintf(hash_out + i*2, 3, format, digest[i]);
+}
+
+static uint32_t crc32c_table[8][256];
+
+static bool crc32c_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 8; k++)
+            crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+    return true;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* data, size_t size)
+{
+    static bool init = crc32c_init();
+    (void)init;
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^ crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^ crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; size > 0; size--, data++)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data) & 0xFF];
+    return crc;
+}
+
+#if (defined(_MSC_VER) && defined(_M_X64)) || (defined(__GNUC__) && defined(__x86_64__))
+#ifdef __GNUC__
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* data, size_t size)
+{
+    uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        uint64_t value;
+        memcpy(&value, data, 8);
+        crc64 = _mm_crc32_u64(crc64, value);
+    }
+    crc = (uint32_t)crc64;
+    for (; size > 0; size--, data++)
+        crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+
+static bool crc32c_sse42()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size)
+{
+#if (defined(_MSC_VER) && defined(_M_X64)) || (defined(__GNUC__) && defined(__x86_64__))
+    static bool sse42 = crc32c_sse42();
+    if (sse42)
+        return ~crc32c_hw(~crc, (const unsigned char*)data, size);
+#endif
+    return ~crc32c_sw(~crc, (const unsigned char*)data, size);
+}
+
+size_t peak_memory()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+#else
+    FILE* fd = fopen("/proc/self/status", "r");
+    if (fd != nullptr)
+    {
+        char line[256];
+        size_t size = 0;
+        while (fgets(line, sizeof(line), fd) != nullptr)
+            if (strncmp(line, "VmHWM:", 6) == 0)
+                size = (size_t)atoll(line + 6) << 10;
+        fclose(fd);
+        return size;
+    }
+#endif
+    return 0;
+}
+
+void report_peak_memory(Logging& logging)
+{
+    size_t peak = peak_memory();
+    if (peak > 0)
+        logging.result(false, "Peak memory usage: %d MB.\n", (int)(peak >> 20));
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "file.h"
+#include "md5.h"
+
+class Logging;
 
 class LLR2File : public File
 {
@@ -14,3 +17,13 @@ public:
 protected:
     char _type;
 };
+
+// Appends the LLR2 checksum and padding. If md5hash is not null, the MD5 of the result is computed in the same pass.
+void llr2_checksum(Writer& writer, char* md5hash = nullptr);
+// Hex digest in the format of md5_raw_input.
+void md5_hex(char* hash_out, MD5_CTX* context);
+// CRC-32C (Castagnoli), with the SSE4.2 instruction if the CPU has it.
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+// Peak resident memory of the process in bytes, 0 if the platform doesn't report it.
+size_t peak_memory();
+void report_peak_memory(Logging& logging);
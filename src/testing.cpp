@@ -287,6 +287,7 @@ void Test::run(Logging& logging, Params& global)
     File file_recoverypoint("prst_r", fingerprint);
 
     GWState gwstate;
+    GWScratchPool scratch(gwstate);
     gwstate.thread_count = global.thread_count;
     gwstate.spin_threads = global.spin_threads;
     input.setup(gwstate);
@@ -299,7 +300,7 @@ void Test::run(Logging& logging, Params& global)
         file_proofproduct.clear(true);
         file_checkpoint.clear(true);
         file_recoverypoint.clear(true);
-        gwstate.done();
+        GWScratchPool::done(gwstate);
     };
     try
     {
@@ -325,7 +326,29 @@ void Test::run(Logging& logging, Params& global)
             throw TaskAbortException();
         }
 
-        gwstate.done();
+        // The same points with the reference loops instead of the squaring kernels.
+        Params params_reference = params;
+        params_reference.ReferenceKernel = true;
+        file_proofpoint.clear(true);
+        file_proofproduct.clear(true);
+        file_checkpoint.clear(true);
+        file_recoverypoint.clear(true);
+        Proof proof_reference(Proof::SAVE, proof_count, input, params_reference, file_cert, logging);
+        Fermat fermat_reference(Fermat::AUTO, input, params_reference, logging, &proof_reference);
+        proof_reference.init_files(&file_proofpoint, &file_proofproduct, &file_cert);
+        fermat_reference.run(input, gwstate, file_checkpoint, file_recoverypoint, logging, &proof_reference);
+        if (fermat_reference.success() != (res64 == 1) || (!fermat_reference.success() && std::stoull(fermat_reference.res64(), nullptr, 16) != res64))
+        {
+            logging.error("Reference kernel RES64 mismatch.\n");
+            throw TaskAbortException();
+        }
+        if (std::stoull(proof_reference.res64(), nullptr, 16) != cert64)
+        {
+            logging.error("Reference kernel raw certificate mismatch.\n");
+            throw TaskAbortException();
+        }
+
+        GWScratchPool::done(gwstate);
         gwstate.next_fft_count = 1;
         input.setup(gwstate);
         logging.info("Using %s.\n", gwstate.fft_description.data());
@@ -352,7 +375,7 @@ void Test::run(Logging& logging, Params& global)
             throw TaskAbortException();
         }
 
-        gwstate.done();
+        GWScratchPool::done(gwstate);
         gwstate.next_fft_count = 0;
         input.setup(gwstate);
         logging.info("Using %s.\n", gwstate.fft_description.data());
@@ -364,6 +387,30 @@ void Test::run(Logging& logging, Params& global)
             logging.error("Certificate mismatch.\n");
             throw TaskAbortException();
         }
+
+        if (input.b() == 2 && !(params.CheckStrong && params.CheckStrong.value()))
+        {
+            file_cert.clear();
+            file_checkpoint.clear(true);
+            file_recoverypoint.clear(true);
+            Proof proof_w(Proof::WESOLOWSKI, 16, input, params, file_cert, logging);
+            Fermat fermat_w(Fermat::AUTO, input, params, logging, &proof_w);
+            proof_w.init_files(nullptr, nullptr, &file_cert);
+            fermat_w.run(input, gwstate, file_checkpoint, file_recoverypoint, logging, &proof_w);
+            if (fermat_w.success() != (res64 == 1) || (!fermat_w.success() && std::stoull(fermat_w.res64(), nullptr, 16) != res64))
+            {
+                logging.error("Wesolowski RES64 mismatch.\n");
+                throw TaskAbortException();
+            }
+
+            Proof proof_wcert(Proof::CERT, 0, input, params, file_cert, logging);
+            proof_wcert.run(input, gwstate, file_checkpoint, file_recoverypoint, logging);
+            if (proof_w.res64().empty() || std::stoull(proof_wcert.res64(), nullptr, 16) != std::stoull(proof_w.res64(), nullptr, 16))
+            {
+                logging.error("Wesolowski certificate mismatch.\n");
+                throw TaskAbortException();
+            }
+        }
     }
     catch (const TaskAbortException&)
     {
@@ -407,6 +454,7 @@ void RootsTest(Logging& logging, Params& global)
     proof_build.init_files(&file_proofpoint, &file_proofproduct, &file_cert);
 
     GWState gwstate;
+    GWScratchPool scratch(gwstate);
     gwstate.thread_count = global.thread_count;
     gwstate.spin_threads = global.spin_threads;
     gwstate.maxmulbyconst = fermat.a();
@@ -420,7 +468,7 @@ void RootsTest(Logging& logging, Params& global)
         file_proofproduct.clear(true);
         file_checkpoint.clear(true);
         file_recoverypoint.clear(true);
-        gwstate.done();
+        GWScratchPool::done(gwstate);
     };
     try
     {
@@ -0,0 +1,364 @@
+#!/usr/bin/env python3
+"""Local stand-in for the PRST task server and a load-test harness for -net workers.
+
+Server only:
+    netmock.py serve [--port 8080] --task "3*2^20000+1" ...
+
+Harness, runs N workers against an in-process server and reports per worker throughput:
+    netmock.py run --prst ./prst --workers 4 --range "3*2^{n}+1" 20000 20100 [-- <worker options>]
+
+The server implements the endpoints used by src/net.cpp:
+    POST llr/new                 task assignment (JSON)
+    GET/HEAD/PUT llr/<id>/<file> task files, with MD5 header, Range requests and chunked uploads
+    POST llr/res/<id>            result
+    POST llr/hb/<id>             heartbeat
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+NUMBER_RE = re.compile(r'^(\d+)\*(\d+)\^(\d+)([+-]\d+)$')
+
+
+class Task:
+    def __init__(self, index, number, mode, options):
+        m = NUMBER_RE.match(number)
+        if m is None:
+            raise ValueError('number must be K*B^N+C: ' + number)
+        self.id = 't%05d' % index
+        self.number = number
+        self.sk, self.sb, self.n, self.c = m.group(1), m.group(2), int(m.group(3)), int(m.group(4))
+        self.mode = mode
+        self.options = options
+        self.files = {}
+        self.chunks = {}
+        self.worker = None
+        self.assigned = None
+        self.done = None
+        self.result = None
+        self.progress = 0.0
+
+    def json(self):
+        return {'id': self.id, 'type': 'Fermat', 'sk': self.sk, 'sb': self.sb, 'n': self.n, 'c': self.c,
+                'mode': self.mode, 'time': 0.0, 'options': self.options}
+
+
+class Worker:
+    def __init__(self, worker_id):
+        self.id = worker_id
+        self.uptime = -1
+        self.tasks = []
+        self.completed = 0
+        self.idle = 0.0
+        self.idle_since = time.time()
+        self.upload_bytes = 0
+        self.download_bytes = 0
+        self.requests = 0
+
+
+class MockServer:
+    def __init__(self, tasks, timeout=0, log=False):
+        self.tasks = tasks
+        self.by_id = {task.id: task for task in tasks}
+        self.workers = {}
+        self.timeout = timeout
+        self.log = log
+        self.lock = threading.Lock()
+        self.finished = threading.Event()
+        if not tasks:
+            self.finished.set()
+
+    def worker(self, worker_id):
+        if worker_id not in self.workers:
+            self.workers[worker_id] = Worker(worker_id)
+        return self.workers[worker_id]
+
+    def expired(self, task):
+        return self.timeout > 0 and task.done is None and time.time() - task.assigned > self.timeout
+
+    # A restarted worker, its uptime went down, gets its unfinished task back. Otherwise it gets a new one,
+    # so a prefetch near the end of the current task is served.
+    def new_task(self, worker, uptime):
+        restarted = uptime < worker.uptime
+        worker.uptime = uptime
+        worker.tasks = [task for task in worker.tasks if task.done is None and not self.expired(task)]
+        if restarted and worker.tasks:
+            return worker.tasks[0]
+        for task in self.tasks:
+            if task.done is not None or (task.worker is not None and not self.expired(task)):
+                continue
+            task.worker = worker.id
+            task.assigned = time.time()
+            task.files.clear()
+            task.chunks.clear()
+            if not worker.tasks:
+                worker.idle += time.time() - worker.idle_since
+            worker.tasks.append(task)
+            return task
+        return None
+
+    def report(self, out=sys.stdout, elapsed=None):
+        out.write('%-16s %6s %10s %12s %12s %10s %10s\n' % ('worker', 'tasks', 'tasks/h', 'upload', 'download', 'idle', 'requests'))
+        total = Worker('total')
+        for worker in sorted(self.workers.values(), key=lambda w: w.id):
+            span = elapsed if elapsed else max(worker.uptime, 1)
+            out.write('%-16s %6d %10.1f %9.1f MB %9.1f MB %8.1f s %10d\n' % (worker.id, worker.completed, worker.completed*3600.0/span,
+                      worker.upload_bytes/1048576.0, worker.download_bytes/1048576.0, worker.idle, worker.requests))
+            total.completed += worker.completed
+            total.upload_bytes += worker.upload_bytes
+            total.download_bytes += worker.download_bytes
+            total.idle += worker.idle
+            total.requests += worker.requests
+        if elapsed:
+            out.write('%-16s %6d %10.1f %9.1f MB %9.1f MB %8.1f s %10d\n' % ('total', total.completed, total.completed*3600.0/elapsed,
+                      total.upload_bytes/1048576.0, total.download_bytes/1048576.0, total.idle, total.requests))
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    server_version = 'netmock'
+
+    def log_message(self, format, *args):
+        if self.server.mock.log:
+            BaseHTTPRequestHandler.log_message(self, format, *args)
+
+    def parse(self):
+        url = urlparse(self.path)
+        args = {key: values[0] for key, values in parse_qs(url.query).items()}
+        path = url.path.split('/')
+        if 'llr' not in path:
+            return None, args
+        return path[path.index('llr') + 1:], args
+
+    def reply(self, code, body=b'', headers=None):
+        self.send_response(code)
+        for key, value in (headers or {}).items():
+            self.send_header(key, value)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if body and self.command != 'HEAD':
+            self.wfile.write(body)
+
+    def body(self):
+        length = int(self.headers.get('Content-Length', 0))
+        return self.rfile.read(length) if length > 0 else b''
+
+    def lookup(self, path, args):
+        mock = self.server.mock
+        task = mock.by_id.get(path[1] if path[0] in ('res', 'hb') else path[0])
+        worker = mock.worker(args.get('workerID', ''))
+        worker.requests += 1
+        if task is None or task.worker != worker.id or task.done is not None:
+            self.reply(403)
+            return None, worker
+        if mock.expired(task):
+            self.reply(401)
+            return None, worker
+        return task, worker
+
+    def do_POST(self):
+        mock = self.server.mock
+        path, args = self.parse()
+        self.body()
+        with mock.lock:
+            if path == ['new']:
+                worker = mock.worker(args.get('workerID', ''))
+                worker.requests += 1
+                task = mock.new_task(worker, int(args.get('uptime', 0)))
+                if task is None:
+                    self.reply(404)
+                    return
+                self.reply(200, json.dumps(task.json()).encode(), {'Content-Type': 'application/json'})
+                return
+            if path is None or len(path) != 2 or path[0] not in ('res', 'hb'):
+                self.reply(404)
+                return
+            task, worker = self.lookup(path, args)
+            if task is None:
+                return
+            if path[0] == 'hb':
+                task.progress = float(args.get('progress', task.progress))
+                self.reply(200)
+                return
+            task.result = args.get('res', '')
+            task.done = time.time()
+            worker.completed += 1
+            worker.tasks = [t for t in worker.tasks if t.done is None]
+            if not worker.tasks:
+                worker.idle_since = time.time()
+            print('%s %s %s %s' % (worker.id, task.number, task.result, args.get('cert', '')), flush=True)
+            if all(t.done is not None for t in mock.tasks):
+                mock.finished.set()
+            self.reply(200)
+
+    def do_HEAD(self):
+        self.do_GET()
+
+    def do_GET(self):
+        mock = self.server.mock
+        path, args = self.parse()
+        with mock.lock:
+            if path is None or len(path) < 2:
+                self.reply(404)
+                return
+            task, worker = self.lookup(path, args)
+            if task is None:
+                return
+            data = task.files.get('/'.join(path[1:]))
+            if data is None:
+                self.reply(404)
+                return
+            headers = {'MD5': hashlib.md5(data).hexdigest()}
+            code = 200
+            m = re.match(r'bytes=(\d+)-(\d*)', self.headers.get('Range', ''))
+            if m is not None:
+                first = int(m.group(1))
+                last = min(int(m.group(2)) if m.group(2) else len(data) - 1, len(data) - 1)
+                headers['Content-Range'] = 'bytes %d-%d/%d' % (first, last, len(data))
+                data = data[first:last + 1]
+                code = 206
+            if self.command == 'GET':
+                worker.download_bytes += len(data)
+            self.reply(code, data, headers)
+
+    def do_PUT(self):
+        mock = self.server.mock
+        path, args = self.parse()
+        data = self.body()
+        with mock.lock:
+            if path is None or len(path) < 2:
+                self.reply(404)
+                return
+            task, worker = self.lookup(path, args)
+            if task is None:
+                return
+            worker.upload_bytes += len(data)
+            if 'progress' in args:
+                task.progress = float(args['progress'])
+            filename = '/'.join(path[1:])
+            if 'offset' in args:
+                if hashlib.md5(data).hexdigest() != args.get('chunk_md5'):
+                    self.reply(400)
+                    return
+                offset, size = int(args['offset']), int(args['size'])
+                chunk = task.chunks.setdefault(filename, bytearray(size))
+                chunk[offset:offset + len(data)] = data
+                if offset + len(data) < size:
+                    self.reply(200)
+                    return
+                data = bytes(task.chunks.pop(filename))
+            if data and 'md5' in args and args['md5'] and hashlib.md5(data).hexdigest() != args['md5']:
+                self.reply(400)
+                return
+            if data:
+                task.files[filename] = data
+            else:
+                task.files.pop(filename, None)
+            self.reply(200)
+
+
+def start_server(mock, port):
+    server = ThreadingHTTPServer(('127.0.0.1', port), Handler)
+    server.daemon_threads = True
+    server.mock = mock
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+    return server
+
+
+def make_tasks(args):
+    numbers = list(args.task or [])
+    if args.range:
+        pattern, first, last = args.range[0], int(args.range[1]), int(args.range[2])
+        numbers += [pattern.replace('{n}', str(n)) for n in range(first, last + 1)]
+    options = dict(option.split('=', 1) for option in args.option or [])
+    return [Task(i, number, args.mode, options) for i, number in enumerate(numbers)]
+
+
+def serve(args):
+    mock = MockServer(make_tasks(args), args.timeout, args.log)
+    server = start_server(mock, args.port)
+    print('Serving %d tasks on http://127.0.0.1:%d/api/' % (len(mock.tasks), server.server_address[1]), flush=True)
+    try:
+        while not mock.finished.wait(1):
+            pass
+    except KeyboardInterrupt:
+        pass
+    server.shutdown()
+    mock.report()
+
+
+def run(args):
+    mock = MockServer(make_tasks(args), args.timeout, args.log)
+    server = start_server(mock, args.port)
+    url = 'http://127.0.0.1:%d/api/' % server.server_address[1]
+    workdir = tempfile.mkdtemp(prefix='netmock')
+    workers = []
+    start = time.time()
+    for i in range(args.workers):
+        cwd = os.path.join(workdir, 'w%d' % (i + 1))
+        os.makedirs(cwd)
+        command = [os.path.abspath(args.prst), '-net', '-i', 'w%d' % (i + 1)] + args.worker_args + [url]
+        workers.append(subprocess.Popen(command, cwd=cwd, stdout=subprocess.DEVNULL if not args.log else None))
+    try:
+        finished = mock.finished.wait(args.duration if args.duration > 0 else None)
+    except KeyboardInterrupt:
+        finished = False
+    elapsed = time.time() - start
+    for worker in workers:
+        worker.send_signal(signal.SIGINT)
+    for worker in workers:
+        try:
+            worker.wait(30)
+        except subprocess.TimeoutExpired:
+            worker.kill()
+    server.shutdown()
+    shutil.rmtree(workdir, ignore_errors=True)
+
+    with mock.lock:
+        for worker in mock.workers.values():
+            if not worker.tasks:
+                worker.idle += start + elapsed - worker.idle_since
+        print('%s in %.1f s.' % ('All tasks done' if finished else 'Stopped', elapsed))
+        mock.report(elapsed=elapsed)
+    return 0 if finished else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Local PRST task server and -net load-test harness.')
+    sub = parser.add_subparsers(dest='command', required=True)
+    for name in ('serve', 'run'):
+        p = sub.add_parser(name)
+        p.add_argument('--port', type=int, default=8080 if name == 'serve' else 0)
+        p.add_argument('--task', action='append', help='K*B^N+C, can be repeated')
+        p.add_argument('--range', nargs=3, metavar=('PATTERN', 'FIRST', 'LAST'), help='tasks with {n} in PATTERN from FIRST to LAST')
+        p.add_argument('--mode', default='', help='task mode, e.g. SavePoints')
+        p.add_argument('--option', action='append', help='task option KEY=VALUE, can be repeated')
+        p.add_argument('--timeout', type=int, default=0, help='seconds after which a task times out')
+        p.add_argument('--log', action='store_true', help='show requests and worker output')
+        if name == 'run':
+            p.add_argument('--prst', required=True, help='path to the PRST executable')
+            p.add_argument('--workers', type=int, default=1)
+            p.add_argument('--duration', type=int, default=0, help='stop after this many seconds')
+            p.add_argument('worker_args', nargs='*', help='options passed to the workers, after --')
+    args = parser.parse_args()
+    if args.command == 'serve':
+        serve(args)
+        return 0
+    return run(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())